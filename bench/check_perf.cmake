@@ -0,0 +1,78 @@
+# Run a benchmark and compare its key=value output against a stored baseline.
+#
+# Invoked by CTest as
+#   cmake -DBENCH=<exe> [-DBENCH_ARGS=a;b] -DBASELINE=<file> [-DUPDATE=ON] -P check_perf.cmake
+#
+# Each non-comment line of the baseline file reads
+#   <metric> <baseline value> <higher|lower> <tolerance percent>
+# where higher/lower says which direction is better. A metric fails when it is
+# worse than the baseline by more than the tolerance. With UPDATE=ON the file is
+# rewritten with the measured values instead, keeping directions and tolerances.
+
+if(NOT BENCH OR NOT BASELINE)
+    message(FATAL_ERROR "check_perf.cmake needs BENCH and BASELINE")
+endif()
+
+execute_process(
+    COMMAND ${BENCH} ${BENCH_ARGS}
+    OUTPUT_VARIABLE output
+    RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${BENCH} exited with ${result}\n${output}")
+endif()
+message("${output}")
+
+string(REPLACE "\n" ";" output_lines "${output}")
+foreach(line IN LISTS output_lines)
+    if(line MATCHES "^([A-Za-z0-9_]+)=([0-9]+)$")
+        set(measured_${CMAKE_MATCH_1} ${CMAKE_MATCH_2})
+    endif()
+endforeach()
+
+file(STRINGS ${BASELINE} baseline_lines)
+set(failures "")
+set(updated "")
+foreach(line IN LISTS baseline_lines)
+    if(line MATCHES "^#" OR line STREQUAL "")
+        string(APPEND updated "${line}\n")
+        continue()
+    endif()
+    if(NOT line MATCHES "^([A-Za-z0-9_]+)[ \t]+([0-9]+)[ \t]+(higher|lower)[ \t]+([0-9]+)$")
+        message(FATAL_ERROR "Malformed baseline line in ${BASELINE}: '${line}'")
+    endif()
+    set(metric ${CMAKE_MATCH_1})
+    set(expected ${CMAKE_MATCH_2})
+    set(direction ${CMAKE_MATCH_3})
+    set(tolerance ${CMAKE_MATCH_4})
+
+    if(NOT DEFINED measured_${metric})
+        message(FATAL_ERROR "${BENCH} did not report ${metric}")
+    endif()
+    set(value ${measured_${metric}})
+    string(APPEND updated "${metric} ${value} ${direction} ${tolerance}\n")
+
+    # Integer-only comparison: value * 100 against baseline * (100 -/+ tolerance)
+    math(EXPR scaled_value "${value} * 100")
+    if(direction STREQUAL "higher")
+        math(EXPR limit "${expected} * (100 - ${tolerance})")
+        if(scaled_value LESS limit)
+            list(APPEND failures "${metric}: ${value} is more than ${tolerance}% below baseline ${expected}")
+        endif()
+    else()
+        math(EXPR limit "${expected} * (100 + ${tolerance})")
+        if(scaled_value GREATER limit)
+            list(APPEND failures "${metric}: ${value} is more than ${tolerance}% above baseline ${expected}")
+        endif()
+    endif()
+endforeach()
+
+if(UPDATE)
+    file(WRITE ${BASELINE} "${updated}")
+    message("Updated ${BASELINE}")
+    return()
+endif()
+
+if(failures)
+    string(REPLACE ";" "\n  " failures "${failures}")
+    message(FATAL_ERROR "Performance regression against ${BASELINE}:\n  ${failures}")
+endif()
@@ -0,0 +1,250 @@
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_NODES 100000 /**< List length when none is given */
+#define TRAVERSALS 20 /**< Full passes over the list per measurement */
+#define PAGE 4096 /**< Page size used to count page switches */
+#define HOT_SIZE 1000 /**< Size of the objects in the hot-set test */
+#define HOT_OBJECTS 8192 /**< Objects allocated for the hot-set test */
+#define HOT_SETS 48 /**< Hot objects: the first object of this many slabs */
+#define HOT_PASSES 10000 /**< Passes over the hot objects */
+
+/**
+ * A list node the size of the one in src/main.c plus some payload
+ */
+typedef struct node {
+    struct node *next;
+    long data[3];
+} node;
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The current time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Small deterministic generator so runs are comparable across machines and libcs
+ *
+ * @param state The generator state
+ * @return The next pseudo-random number
+ */
+static uint32_t next_rand(uint64_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(*state >> 33);
+}
+
+/**
+ * Results for one way of building the list
+ */
+typedef struct list_stats {
+    uint64_t build_ps; /**< Time per node to build the list, in picoseconds */
+    uint64_t traverse_ps; /**< Time per node of a traversal, in picoseconds */
+    size_t page_switches; /**< Consecutive nodes that sit on different pages */
+} list_stats;
+
+/**
+ * Fragment the heap, build a list in it and walk the list
+ *
+ * Half of a batch of same-sized filler blocks is freed in random order
+ * first, and filler blocks keep being freed and allocated while the list
+ * grows, so the blocks at hand for the next node are scattered.
+ *
+ * @param nodes How many nodes the list gets
+ * @param near Whether to build with tumalloc_near
+ * @param state The generator state
+ * @param stats Filled in with the results
+ * @return 0, or 1 if an allocation failed
+ */
+static int run(size_t nodes, int near, uint64_t *state, list_stats *stats) {
+    size_t nfill = nodes * 2;
+    node **fill = tumalloc(nfill * sizeof(node *));
+    if(fill == NULL) {
+        return 1;
+    }
+    for(size_t i = 0; i < nfill; i++) {
+        fill[i] = tumalloc(sizeof(node));
+        if(fill[i] == NULL) {
+            return 1;
+        }
+    }
+    for(size_t i = 0; i < nfill; i++) {
+        size_t j = next_rand(state) % nfill;
+        if(fill[j] && next_rand(state) % 2) {
+            tufree(fill[j]);
+            fill[j] = NULL;
+        }
+    }
+
+    node *head = tumalloc(sizeof(node));
+    if(head == NULL) {
+        return 1;
+    }
+    node *tail = head;
+    uint64_t start = now_ns();
+    for(size_t i = 1; i < nodes; i++) {
+        // Other code keeps freeing and allocating objects of the same size
+        size_t j = next_rand(state) % nfill;
+        if(fill[j]) {
+            tufree(fill[j]);
+            fill[j] = NULL;
+        }
+        else {
+            fill[j] = tumalloc(sizeof(node));
+        }
+
+        node *n = near ? tumalloc_near(tail, sizeof(node)) : tumalloc(sizeof(node));
+        if(n == NULL) {
+            return 1;
+        }
+        n->data[0] = (long)i;
+        tail->next = n;
+        tail = n;
+    }
+    tail->next = NULL;
+    stats->build_ps = (now_ns() - start) * 1000 / nodes;
+
+    stats->page_switches = 0;
+    for(node *n = head; n->next; n = n->next) {
+        if((uintptr_t)n / PAGE != (uintptr_t)n->next / PAGE) {
+            stats->page_switches++;
+        }
+    }
+
+    volatile long sink = 0;
+    start = now_ns();
+    for(int pass = 0; pass < TRAVERSALS; pass++) {
+        long sum = 0;
+        for(node *n = head; n; n = n->next) {
+            sum += n->data[0];
+        }
+        sink += sum;
+    }
+    stats->traverse_ps = (now_ns() - start) * 1000 / (TRAVERSALS * nodes);
+    (void)sink;
+
+    for(node *n = head; n;) {
+        node *next = n->next;
+        tufree(n);
+        n = next;
+    }
+    for(size_t i = 0; i < nfill; i++) {
+        tufree(fill[i]);
+    }
+    tufree(fill);
+    return 0;
+}
+
+/**
+ * Time a pointer chase through the first object of many slabs
+ *
+ * Blocks are handed out in address order within a slab, so a slab starts
+ * wherever two consecutive allocations are not one stride apart. Those
+ * first objects all sit at the same page offset unless slabs are colored,
+ * and then compete for the same cache sets.
+ *
+ * @return Time per read in picoseconds, or 0 if the test could not be set up
+ */
+static uint64_t run_hot(void) {
+    static char *objs[HOT_OBJECTS];
+    static char *hot[HOT_SETS];
+
+    for(size_t i = 0; i < HOT_OBJECTS; i++) {
+        objs[i] = tumalloc(HOT_SIZE);
+        if(objs[i] == NULL) {
+            return 0;
+        }
+    }
+
+    uintptr_t stride = UINTPTR_MAX;
+    for(size_t i = 1; i < HOT_OBJECTS; i++) {
+        uintptr_t diff = (uintptr_t)objs[i] - (uintptr_t)objs[i - 1];
+        if(objs[i] > objs[i - 1] && diff < stride) {
+            stride = diff;
+        }
+    }
+    size_t nhot = 0;
+    for(size_t i = 1; i < HOT_OBJECTS && nhot < HOT_SETS; i++) {
+        if((uintptr_t)objs[i] - (uintptr_t)objs[i - 1] != stride) {
+            hot[nhot++] = objs[i];
+        }
+    }
+
+    if(nhot == 0) {
+        return 0;
+    }
+
+    // Link the hot objects into a ring so every read waits for the one before
+    for(size_t i = 0; i < nhot; i++) {
+        *(char **)hot[i] = hot[(i + 1) % nhot];
+    }
+
+    char *volatile sink;
+    char *p = hot[0];
+    uint64_t start = now_ns();
+    for(long i = 0; i < (long)HOT_PASSES * (long)nhot; i++) {
+        p = *(char **)p;
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink = p;
+    (void)sink;
+
+    for(size_t i = 0; i < HOT_OBJECTS; i++) {
+        tufree(objs[i]);
+    }
+    return elapsed * 1000 / ((uint64_t)HOT_PASSES * nhot);
+}
+
+/**
+ * Build the same list in a fragmented heap with tumalloc and with tumalloc_near,
+ * then time a hot set made of the first block of many slabs
+ *
+ * Usage: locality_bench [nodes] [seed]
+ */
+int main(int argc, char **argv) {
+    long nodes = argc > 1 ? atol(argv[1]) : DEFAULT_NODES;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 3053;
+
+    if(nodes < 2) {
+        fprintf(stderr, "usage: %s [nodes] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    list_stats plain;
+    list_stats near;
+    uint64_t state = seed;
+    if(run((size_t)nodes, 0, &state, &plain)) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+    state = seed;
+    if(run((size_t)nodes, 1, &state, &near)) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    uint64_t hot_ps = run_hot();
+    if(hot_ps == 0) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    printf("nodes=%ld\n", nodes);
+    printf("plain_build_ps_per_node=%llu\n", (unsigned long long)plain.build_ps);
+    printf("plain_traverse_ps_per_node=%llu\n", (unsigned long long)plain.traverse_ps);
+    printf("plain_page_switches=%zu\n", plain.page_switches);
+    printf("near_build_ps_per_node=%llu\n", (unsigned long long)near.build_ps);
+    printf("near_traverse_ps_per_node=%llu\n", (unsigned long long)near.traverse_ps);
+    printf("near_page_switches=%zu\n", near.page_switches);
+    printf("hot_first_block_ps_per_read=%llu\n", (unsigned long long)hot_ps);
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_RUNS 200 /**< Number of fork+exec rounds when none is given */
+#define FIRST_ALLOCS 10000 /**< Allocations timed after the first one */
+
+/**
+ * Timestamps reported by a child process back to the parent
+ */
+typedef struct startup_sample {
+    uint64_t main_ns; /**< Time main() started in the child */
+    uint64_t first_start_ns; /**< Time right before the first tumalloc */
+    uint64_t first_end_ns; /**< Time right after the first tumalloc */
+    uint64_t burst_end_ns; /**< Time after the following FIRST_ALLOCS allocations */
+    size_t footprint; /**< Bytes the program break moved during the run */
+} startup_sample;
+
+/**
+ * Read the monotonic clock, which is shared between parent and child
+ *
+ * @return The current time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Compare two uint64_t values for qsort
+ */
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort a sample array and print its median and 90th percentile
+ *
+ * @param name The metric name
+ * @param values The samples, sorted in place
+ * @param count How many samples there are
+ */
+static void report(const char *name, uint64_t *values, int count) {
+    qsort(values, count, sizeof(uint64_t), cmp_u64);
+    printf("%s_median=%llu\n", name, (unsigned long long)values[count / 2]);
+    printf("%s_p90=%llu\n", name, (unsigned long long)values[(count * 9) / 10]);
+}
+
+/**
+ * Body of the exec'd child: time the first allocations of a fresh process
+ *
+ * @param fd The pipe to write the sample to
+ * @param main_ns The time main() was entered
+ * @return The process exit code
+ */
+static int run_child(int fd, uint64_t main_ns) {
+    startup_sample sample;
+    char *brk_start = sbrk(0);
+
+    sample.main_ns = main_ns;
+    sample.first_start_ns = now_ns();
+    void *first = tumalloc(64);
+    sample.first_end_ns = now_ns();
+    if(first == NULL) {
+        return 1;
+    }
+
+    // Mixed small sizes, kept alive so the heap has to keep growing
+    for(int i = 0; i < FIRST_ALLOCS; i++) {
+        if(tumalloc(16 + (i % 16) * 16) == NULL) {
+            return 1;
+        }
+    }
+    sample.burst_end_ns = now_ns();
+    sample.footprint = (size_t)((char *)sbrk(0) - brk_start);
+
+    if(write(fd, &sample, sizeof(sample)) != sizeof(sample)) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Measure allocator first-use costs in fresh processes
+ *
+ * Usage: startup_bench [runs]
+ */
+int main(int argc, char **argv) {
+    uint64_t main_ns = now_ns();
+
+    if(argc == 3 && strcmp(argv[1], "--child") == 0) {
+        return run_child(atoi(argv[2]), main_ns);
+    }
+
+    int runs = argc > 1 ? atoi(argv[1]) : DEFAULT_RUNS;
+    if(runs <= 0) {
+        fprintf(stderr, "usage: %s [runs]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t *to_first = calloc(runs, sizeof(uint64_t));
+    uint64_t *first = calloc(runs, sizeof(uint64_t));
+    uint64_t *burst = calloc(runs, sizeof(uint64_t));
+    size_t footprint = 0;
+    if(!to_first || !first || !burst) {
+        return 1;
+    }
+
+    for(int i = 0; i < runs; i++) {
+        int fds[2];
+        if(pipe(fds) != 0) {
+            perror("pipe");
+            return 1;
+        }
+
+        uint64_t spawn_ns = now_ns();
+        pid_t pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if(pid == 0) {
+            char fd_arg[16];
+            snprintf(fd_arg, sizeof(fd_arg), "%d", fds[1]);
+            close(fds[0]);
+            execl("/proc/self/exe", argv[0], "--child", fd_arg, (char *)NULL);
+            _exit(127);
+        }
+
+        close(fds[1]);
+        startup_sample sample;
+        ssize_t got = read(fds[0], &sample, sizeof(sample));
+        close(fds[0]);
+
+        int status;
+        waitpid(pid, &status, 0);
+        if(got != sizeof(sample) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "child run %d failed\n", i);
+            return 1;
+        }
+
+        to_first[i] = sample.first_end_ns - spawn_ns;
+        first[i] = sample.first_end_ns - sample.first_start_ns;
+        burst[i] = sample.burst_end_ns - sample.first_end_ns;
+        footprint = sample.footprint;
+    }
+
+    printf("runs=%d\n", runs);
+    report("spawn_to_first_alloc_ns", to_first, runs);
+    report("first_alloc_ns", first, runs);
+    report("first_10k_allocs_ns", burst, runs);
+    printf("footprint_bytes=%zu\n", footprint);
+
+    free(to_first);
+    free(first);
+    free(burst);
+    return 0;
+}
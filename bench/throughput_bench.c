@@ -0,0 +1,102 @@
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_OPS 200000 /**< Number of operations when none is given */
+#define LIVE_SLOTS 4096 /**< Maximum number of live allocations */
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The current time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Small deterministic generator so runs are comparable across machines and libcs
+ *
+ * @param state The generator state
+ * @return The next pseudo-random number
+ */
+static uint32_t next_rand(uint64_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(*state >> 33);
+}
+
+/**
+ * Pick an allocation size: mostly small objects with an occasional larger buffer
+ *
+ * @param state The generator state
+ * @return The size to allocate
+ */
+static size_t pick_size(uint64_t *state) {
+    uint32_t r = next_rand(state);
+    if(r % 64 == 0) {
+        return 1024 + r % 8192;
+    }
+    return 8 + r % 512;
+}
+
+/**
+ * Random alloc/free churn over a fixed pool of live slots
+ *
+ * Usage: throughput_bench [ops] [seed]
+ */
+int main(int argc, char **argv) {
+    long ops = argc > 1 ? atol(argv[1]) : DEFAULT_OPS;
+    uint64_t state = argc > 2 ? strtoull(argv[2], NULL, 10) : 3053;
+    static void *slots[LIVE_SLOTS];
+
+    if(ops <= 0) {
+        fprintf(stderr, "usage: %s [ops] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    char *brk_start = sbrk(0);
+    size_t peak = 0;
+
+    uint64_t start = now_ns();
+    for(long i = 0; i < ops; i++) {
+        uint32_t slot = next_rand(&state) % LIVE_SLOTS;
+        if(slots[slot]) {
+            tufree(slots[slot]);
+            slots[slot] = NULL;
+            continue;
+        }
+
+        size_t size = pick_size(&state);
+        char *p = tumalloc(size);
+        if(p == NULL) {
+            fprintf(stderr, "allocation of %zu bytes failed\n", size);
+            return 1;
+        }
+        // Touch both ends so the block is really used
+        p[0] = 1;
+        p[size - 1] = 1;
+        slots[slot] = p;
+
+        size_t footprint = (size_t)((char *)sbrk(0) - brk_start);
+        if(footprint > peak) {
+            peak = footprint;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    for(int i = 0; i < LIVE_SLOTS; i++) {
+        tufree(slots[i]);
+    }
+
+    printf("ops=%ld\n", ops);
+    printf("elapsed_ns=%llu\n", (unsigned long long)elapsed);
+    printf("ops_per_sec=%llu\n", (unsigned long long)(ops * 1000000000ull / (elapsed ? elapsed : 1)));
+    printf("peak_footprint_bytes=%zu\n", peak);
+    return 0;
+}
@@ -0,0 +1,99 @@
+# Generates the small size-class tables used by the tumalloc fast path.
+#
+# Classes start at 16 bytes and step by 16 up to 16 * TU_CLASSES_PER_DOUBLING,
+# then every power-of-two range is split into TU_CLASSES_PER_DOUBLING equal
+# steps up to TU_SMALL_MAX. Each class gets the smallest power-of-two number of
+# pages (up to TU_MAX_SLAB_PAGES) that holds TU_MIN_SLAB_SLOTS blocks and wastes
+# at most 1/8 of the slab.
+
+set(TU_CLASSES_PER_DOUBLING 4 CACHE STRING "Small size classes per power of two (power of two)")
+set(TU_SMALL_MAX 1024 CACHE STRING "Largest request served from size classes (power of two)")
+set(TU_PAGE_SIZE 4096 CACHE STRING "Page size assumed for slab geometry")
+set(TU_MAX_SLAB_PAGES 8 CACHE STRING "Largest slab, in pages")
+set(TU_MIN_SLAB_SLOTS 16 CACHE STRING "Blocks a slab should hold when it fits in TU_MAX_SLAB_PAGES")
+
+# Header in front of every slot; must match sizeof(free_block)
+set(TU_SLOT_HEADER 16)
+# Fixed part of the slab header in src/slab.c, before its free-slot bitmap
+set(TU_SLAB_HEADER_FIXED 32)
+
+function(tu_generate_size_classes output)
+    math(EXPR per_doubling_check "${TU_CLASSES_PER_DOUBLING} & (${TU_CLASSES_PER_DOUBLING} - 1)")
+    math(EXPR small_max_check "${TU_SMALL_MAX} & (${TU_SMALL_MAX} - 1)")
+    math(EXPR first_group "16 * ${TU_CLASSES_PER_DOUBLING}")
+    if(TU_CLASSES_PER_DOUBLING LESS 1 OR NOT per_doubling_check EQUAL 0)
+        message(FATAL_ERROR "TU_CLASSES_PER_DOUBLING must be a power of two")
+    endif()
+    if(NOT small_max_check EQUAL 0 OR TU_SMALL_MAX LESS first_group)
+        message(FATAL_ERROR "TU_SMALL_MAX must be a power of two of at least ${first_group}")
+    endif()
+
+    # Class sizes
+    set(sizes "")
+    set(size 16)
+    while(size LESS first_group)
+        list(APPEND sizes ${size})
+        math(EXPR size "${size} + 16")
+    endwhile()
+    list(APPEND sizes ${first_group})
+    set(base ${first_group})
+    while(base LESS TU_SMALL_MAX)
+        math(EXPR step "${base} / ${TU_CLASSES_PER_DOUBLING}")
+        foreach(i RANGE 1 ${TU_CLASSES_PER_DOUBLING})
+            math(EXPR size "${base} + ${i} * ${step}")
+            list(APPEND sizes ${size})
+        endforeach()
+        math(EXPR base "${base} * 2")
+    endwhile()
+    list(LENGTH sizes num_classes)
+
+    # Slab header: fixed fields plus a bitmap big enough for the densest slab
+    math(EXPR max_slots "${TU_MAX_SLAB_PAGES} * ${TU_PAGE_SIZE} / (16 + ${TU_SLOT_HEADER})")
+    math(EXPR map_words "(${max_slots} + 63) / 64")
+    math(EXPR slab_header "(${TU_SLAB_HEADER_FIXED} + 8 * ${map_words} + 15) / 16 * 16")
+
+    # Slab geometry
+    set(pages_list "")
+    set(slots_list "")
+    foreach(size IN LISTS sizes)
+        math(EXPR stride "${size} + ${TU_SLOT_HEADER}")
+        set(pages 1)
+        while(TRUE)
+            math(EXPR bytes "${pages} * ${TU_PAGE_SIZE}")
+            math(EXPR waste "(${bytes} - ${slab_header}) % ${stride}")
+            math(EXPR waste_x8 "${waste} * 8")
+            math(EXPR slots "(${bytes} - ${slab_header}) / ${stride}")
+            if((NOT waste_x8 GREATER bytes AND NOT slots LESS TU_MIN_SLAB_SLOTS) OR NOT pages LESS TU_MAX_SLAB_PAGES)
+                break()
+            endif()
+            math(EXPR pages "${pages} * 2")
+        endwhile()
+        list(APPEND pages_list ${pages})
+        list(APPEND slots_list ${slots})
+    endforeach()
+
+    # Size -> class, one entry per 16 bytes
+    set(index_list "")
+    set(cls 0)
+    math(EXPR index_entries "${TU_SMALL_MAX} / 16")
+    foreach(i RANGE 0 ${index_entries})
+        math(EXPR bytes "${i} * 16")
+        list(GET sizes ${cls} class_size)
+        if(bytes GREATER class_size)
+            math(EXPR cls "${cls} + 1")
+        endif()
+        list(APPEND index_list ${cls})
+    endforeach()
+    math(EXPR index_entries "${index_entries} + 1")
+
+    string(REPLACE ";" ", " TU_CLASS_INDEX "${index_list}")
+    string(REPLACE ";" ", " TU_CLASS_SLOT_SIZE "${sizes}")
+    string(REPLACE ";" ", " TU_CLASS_SLAB_PAGES "${pages_list}")
+    string(REPLACE ";" ", " TU_CLASS_SLAB_SLOTS "${slots_list}")
+    set(TU_NUM_CLASSES ${num_classes})
+    set(TU_SLAB_MAP_WORDS ${map_words})
+    set(TU_SLAB_HEADER_SIZE ${slab_header})
+    set(TU_CLASS_INDEX_ENTRIES ${index_entries})
+    configure_file(${CMAKE_CURRENT_FUNCTION_LIST_DIR}/size_classes.h.in ${output} @ONLY)
+    message(STATUS "tumalloc size classes (${num_classes}): ${sizes}")
+endfunction()
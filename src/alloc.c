@@ -1,14 +1,54 @@
-#include "alloc.h"
+#include "internal.h"
+#include "memkern.h"
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
-#define ALIGNMENT 16 /**< The alignment of the memory blocks */
+#define MAX_ALLOC ((size_t)PTRDIFF_MAX / 2) /**< Largest request we hand to sbrk */
+#define HEAP_CHUNK (64 * 1024) /**< Smallest chunk a heap instance borrows from the main heap */
+#define TCACHE_BATCH 16 /**< Blocks a full thread-cache bin sends back to the heap at once */
+#define NEAR_CACHE_SCAN 8 /**< Cached blocks tumalloc_near checks for one on the hint's page */
+#define PRESSURE_HANDLERS 8 /**< Most pressure handlers registered at once */
 
-static free_block *HEAD = NULL; /**< Pointer to the first element of the free list */
+tuheap MAIN_HEAP = { NULL, PTHREAD_MUTEX_INITIALIZER, NULL, 0 }; /**< The heap behind tumalloc */
+
+/**
+ * How much of the break the main heap holds, and how much it may; guarded by the main heap lock
+ */
+static struct {
+    char *start; /**< The break before the heap first grew, NULL until then; set once, read atomically */
+    size_t footprint; /**< Bytes from start to the break, updated whenever the heap moves it; read atomically */
+    size_t soft; /**< Footprint past which the heap gives memory back, 0 for none */
+    size_t hard; /**< Footprint the heap never grows past, 0 for none */
+    int pressure; /**< Set when growing crossed a limit; relieve_locked acts on it */
+} LIMITS = { NULL, 0, 0, 0, 0 };
+
+/**
+ * What to try before an allocation fails; guarded by the main heap lock
+ */
+static struct {
+    tu_pressure_fn fns[PRESSURE_HANDLERS]; /**< Registered handlers, in registration order */
+    void *args[PRESSURE_HANDLERS]; /**< Argument passed to each handler */
+    size_t count; /**< Handlers registered */
+    void *reserve; /**< Memory held back for the first failure, NULL if none or spent */
+} PRESSURE = { { NULL }, { NULL }, 0, NULL };
+
+TU_THREAD_LOCAL tu_tcache tu_tcache_tls __attribute__((tls_model("initial-exec"))); /**< This thread's small-block cache */
+static pthread_key_t TCACHE_KEY; /**< Flushes a thread's cache when the thread exits */
+
+// External definitions of the inline fast paths in alloc.h
+extern inline size_t tu_size_class(size_t size);
+extern inline size_t tu_class_size(size_t cls);
+extern inline size_t tu_block_class(size_t size);
+extern inline void *tumalloc(size_t size);
+extern inline void tu_tcache_push(void *ptr, size_t cls);
+extern inline void tufree(void *ptr);
+extern inline void tufree_sized(void *ptr, size_t size);
 
 /**
  * Split a free block into two blocks
@@ -17,7 +57,7 @@ static free_block *HEAD = NULL; /**< Pointer to the first element of the free li
  * @param size The size of the first new split block
  * @return A pointer to the first block or NULL if the block cannot be split
  */
-void *split(free_block *block, int size) {
+void *split(free_block *block, size_t size) {
     if((block->size < size + sizeof(free_block))) {
         return NULL;
     }
@@ -36,12 +76,14 @@ void *split(free_block *block, int size) {
 /**
  * Find the previous neighbor of a block
  *
+ * @param heap The heap whose free list to search
  * @param block The block to find the previous neighbor of
  * @return A pointer to the previous neighbor or NULL if there is none
  */
-free_block *find_prev(free_block *block) {
-    free_block *curr = HEAD;
+free_block *find_prev(tuheap *heap, free_block *block) {
+    free_block *curr = heap->head;
     while(curr != NULL) {
+        TU_PREFETCH_AHEAD(curr);
         char *next = (char *)curr + curr->size + sizeof(free_block);
         if(next == (char *)block)
             return curr;
@@ -53,14 +95,16 @@ free_block *find_prev(free_block *block) {
 /**
  * Find the next neighbor of a block
  *
+ * @param heap The heap whose free list to search
  * @param block The block to find the next neighbor of
  * @return A pointer to the next neighbor or NULL if there is none
  */
-free_block *find_next(free_block *block) {
+free_block *find_next(tuheap *heap, free_block *block) {
     char *block_end = (char*)block + block->size + sizeof(free_block);
-    free_block *curr = HEAD;
+    free_block *curr = heap->head;
 
     while(curr != NULL) {
+        TU_PREFETCH_AHEAD(curr);
         if((char *)curr == block_end)
             return curr;
         curr = curr->next;
@@ -71,15 +115,17 @@ free_block *find_next(free_block *block) {
 /**
  * Remove a block from the free list
  *
+ * @param heap The heap whose free list holds the block
  * @param block The block to remove
  */
-void remove_free_block(free_block *block) {
-    free_block *curr = HEAD;
+void remove_free_block(tuheap *heap, free_block *block) {
+    free_block *curr = heap->head;
     if(curr == block) {
-        HEAD = block->next;
+        heap->head = block->next;
         return;
     }
     while(curr != NULL) {
+        TU_PREFETCH_AHEAD(curr);
         if(curr->next == block) {
             curr->next = block->next;
             return;
@@ -91,45 +137,50 @@ void remove_free_block(free_block *block) {
 /**
  * Coalesce neighboring free blocks
  *
+ * The block must already be on the free list. Neighbors that get merged into
+ * it (or that it gets merged into) are unlinked so the list stays intact.
+ *
+ * @param heap The heap whose free list holds the block
  * @param block The block to coalesce
  * @return A pointer to the first block of the coalesced blocks
  */
-void *coalesce(free_block *block) {
+void *coalesce(tuheap *heap, free_block *block) {
     if (block == NULL) {
         return NULL;
     }
 
-    free_block *prev = find_prev(block);
-    free_block *next = find_next(block);
+    // find_prev/find_next only return blocks that are directly contiguous
+    free_block *prev = find_prev(heap, block);
+    free_block *next = find_next(heap, block);
 
-    // Coalesce with previous block if it is contiguous.
+    // Merge into the previous block, which keeps its place in the list.
     if (prev != NULL) {
-        char *end_of_prev = (char *)prev + prev->size + sizeof(free_block);
-        if (end_of_prev == (char *)block) {
-            prev->size += block->size + sizeof(free_block);
-
-            // Ensure prev->next is updated to skip over 'block', only if 'block' is directly next to 'prev'.
-            if (prev->next == block) {
-                prev->next = block->next;
-            }
-            block = prev; // Update block to point to the new coalesced block.
-        }
+        remove_free_block(heap, block);
+        prev->size += block->size + sizeof(free_block);
+        block = prev; // Update block to point to the new coalesced block.
     }
 
-    // Coalesce with next block if it is contiguous.
+    // Absorb the next block.
     if (next != NULL) {
-        char *end_of_block = (char *)block + block->size + sizeof(free_block);
-        if (end_of_block == (char *)next) {
-            block->size += next->size + sizeof(free_block);
-
-            // Ensure block->next is updated to skip over 'next'.
-            block->next = next->next;
-        }
+        remove_free_block(heap, next);
+        block->size += next->size + sizeof(free_block);
     }
 
     return block;
 }
 
+/**
+ * Measure the footprint from the break, after the main heap moved it
+ *
+ * Measuring rather than adding up what was moved keeps alignment padding
+ * in front of a block, which no trim gives back, from piling up.
+ */
+static void track_break(void) {
+    char *brk = sbrk(0);
+    size_t footprint = brk > LIMITS.start ? (size_t)(brk - LIMITS.start) : 0;
+    __atomic_store_n(&LIMITS.footprint, footprint, __ATOMIC_RELAXED);
+}
+
 /**
  * Call sbrk to get memory from the OS
  *
@@ -143,13 +194,27 @@ void *do_alloc(size_t size) {
         return NULL;
     }
 
-    size_t total_size = size + sizeof(free_block);  //calculate size of free_block struct + size to allocate
+    if (!LIMITS.start) {
+        __atomic_store_n(&LIMITS.start, (char *)sbrk(0), __ATOMIC_RELEASE);
+    }
+    track_break();      //someone else may have moved the break too
+    size_t pad = (size_t)(-(uintptr_t)sbrk(0)) & (ALIGNMENT - 1);   //someone else may have left the break unaligned
+    size_t total_size = pad + size + sizeof(free_block);  //calculate size of free_block struct + size to allocate
+    if (LIMITS.hard && LIMITS.footprint + total_size > LIMITS.hard) {
+        LIMITS.pressure = 1;
+        return NULL;
+    }
     block = sbrk(total_size);           //increment data space to total size
 
     if(block == ((void *) -1)) {        // standard error output for sbrk()
         return NULL;                    //return NULL if block assignment equivalent to sbrk() error
     }
+    track_break();
+    if (LIMITS.soft && LIMITS.footprint > LIMITS.soft) {
+        LIMITS.pressure = 1;
+    }
 
+    block = (free_block *)((char *)block + pad);
     block->size = size;                 //set block size to size
     block->next = NULL;
 
@@ -157,43 +222,511 @@ void *do_alloc(size_t size) {
 }
 
 /**
- * Allocates memory for the end user
+ * Whether a pointer lies in the part of the break the main heap took
  *
- * @param size The amount of memory to allocate
- * @return A pointer to the requested block of memory
+ * All memory the allocator hands out comes from there, so a pointer
+ * outside it belongs to another allocator, such as the one a preloaded
+ * program used before this one was in place. Memory another allocator
+ * took from the break after the heap first grew is not told apart.
+ *
+ * @param ptr The pointer
+ * @return 1 if it is inside the heap, 0 otherwise
  */
-void *tumalloc(size_t size) {
-    if (size == 0) {
+int heap_owns(const void *ptr) {
+    const char *start = __atomic_load_n(&LIMITS.start, __ATOMIC_ACQUIRE);
+    return start && (const char *)ptr > start && (const char *)ptr < (const char *)sbrk(0);
+}
+
+
+/**
+ * Hand out a block that is already off the free list, returning any excess
+ *
+ * @param heap The heap the block belongs to
+ * @param block The block to use
+ * @param size The amount of memory needed, already aligned
+ * @return A pointer to the usable memory of the block
+ */
+static void *take_block(tuheap *heap, free_block *block, size_t size) {
+    if (block->size >= size + sizeof(free_block)) {    //check if the block has more room than the allotment
+        split(block, size);
+
+        free_block *leftovers = (free_block *)((char *)block + size + sizeof(free_block));     //leftover memory from the split
+        leftovers->next = heap->head;
+        heap->head = leftovers;
+    }
+
+    block->next = NULL;     //not a slab block
+    return (void *)(block + 1);
+}
+
+/**
+ * Borrow a new chunk from the main heap for a heap instance
+ *
+ * @param heap The heap instance to grow
+ * @param size The amount of memory needed, already aligned
+ * @return A pointer to the requested block of memory, or NULL
+ */
+static void *grow_heap(tuheap *heap, size_t size) {
+    size_t want = size + sizeof(heap_chunk) + sizeof(free_block);
+    pressure_hold();
+    heap_chunk *chunk = tumalloc(want > HEAP_CHUNK ? want : HEAP_CHUNK);
+    pressure_release();
+    if (!chunk) {
         return NULL;
     }
 
-    free_block *curr_block = HEAD;          //initialize the current block as HEAD node
+    chunk->next = heap->chunks;
+    heap->chunks = chunk;
+
+    free_block *block = (free_block *)(chunk + 1);
+    block->size = tumalloc_usable_size(chunk) - sizeof(heap_chunk) - sizeof(free_block);
+    block->next = NULL;
+    return take_block(heap, block, size);
+}
+
+/**
+ * First-fit allocation from a heap's free list, growing the heap on a miss
+ *
+ * @param heap The heap to allocate from, locked by the caller
+ * @param size The amount of memory to allocate, already aligned
+ * @return A pointer to the requested block of memory
+ */
+void *alloc_locked(tuheap *heap, size_t size) {
+    free_block *curr_block = heap->head;          //initialize the current block as HEAD node
 
     while(curr_block) {
+        TU_PREFETCH_AHEAD(curr_block);
         if(curr_block->size >= size) {      
-            remove_free_block(curr_block);      //if the allotment is less than the size of the current block, remove the block from the free list
-            if (curr_block->size >= size + sizeof(free_block)) {    //check if the block has more room than the allotment
-                split(curr_block, size);
-
-                free_block *leftovers = (free_block *)((char *)curr_block + size + sizeof(free_block));     //leftover memory from the split
-
-                if(HEAD == NULL || HEAD->next == NULL) {
-                    leftovers->next = NULL;
-                    HEAD = leftovers;
-                }
-                else {
-                    leftovers->next = HEAD;
-                    HEAD = leftovers;
-                }
-            }
-            
-            return (void *)(curr_block + 1);
+            remove_free_block(heap, curr_block);      //if the allotment is less than the size of the current block, remove the block from the free list
+            return take_block(heap, curr_block, size);
         }
 
         curr_block = curr_block->next;
     }
 
-    return do_alloc(size);
+    if (heap == &MAIN_HEAP) {
+        // Grow by at least a step so small requests don't each move the break
+        if (size + 2 * sizeof(free_block) < TUNING.grow_step) {
+            void *ptr = do_alloc(TUNING.grow_step - sizeof(free_block));
+            if (ptr) {
+                return take_block(heap, (free_block *)ptr - 1, size);
+            }
+        }
+        return do_alloc(size);
+    }
+    return grow_heap(heap, size);
+}
+
+/**
+ * Return a block to its heap's free list, or to the OS if it sits at the top of the main heap
+ *
+ * @param heap The heap the block belongs to, locked by the caller
+ * @param ptr Pointer to the allocated piece of memory
+ */
+void free_locked(tuheap *heap, void *ptr) {
+    void *programbreak;             //end of the heap
+    free_block *tmp = (free_block *)((char *)ptr - sizeof(free_block));     //temporary pointer
+
+    if (heap->defer) {
+        // The maintenance thread merges and trims later
+        tmp->next = heap->head;
+        heap->head = tmp;
+        return;
+    }
+
+    programbreak = sbrk(0);     //assign to end of heap
+    if (heap == &MAIN_HEAP && (char *)tmp+ tmp->size + sizeof(free_block) == programbreak) {      //check that the memory we're deallocating is at the end of the heap
+        size_t release = tmp->size + sizeof(free_block);
+        free_block *prev_pointer = find_prev(heap, tmp);       //a free block right below tmp can go back as well
+        if(prev_pointer) {
+            remove_free_block(heap, prev_pointer);
+            release += prev_pointer->size + sizeof(free_block);
+        }
+        sbrk(-(intptr_t)release);            //deallocate memory based on the total size of tmp
+        track_break();
+    }
+    else {
+        tmp->next = heap->head;
+        heap->head = tmp;
+        coalesce(heap, tmp);
+    }
+}
+
+/**
+ * Merge-sort a free list by address
+ *
+ * @param list The list to sort
+ * @return The first block of the sorted list
+ */
+static free_block *sort_by_address(free_block *list) {
+    if (!list || !list->next) {
+        return list;
+    }
+
+    free_block *slow = list;
+    for (free_block *fast = list->next; fast && fast->next; fast = fast->next->next) {
+        slow = slow->next;
+    }
+    free_block *back = slow->next;
+    slow->next = NULL;
+    free_block *front = sort_by_address(list);
+    back = sort_by_address(back);
+
+    free_block head;
+    free_block *tail = &head;
+    while (front && back) {
+        if (front < back) {
+            tail->next = front;
+            front = front->next;
+        }
+        else {
+            tail->next = back;
+            back = back->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = front ? front : back;
+    return head.next;
+}
+
+/**
+ * Merge every run of adjacent free blocks at once, then trim the top of the main heap
+ *
+ * Does in one O(n log n) pass what coalesce does per free, for frees that
+ * skipped it while the heap was deferring.
+ *
+ * @param heap The heap to tidy, locked by the caller
+ */
+void consolidate_locked(tuheap *heap) {
+    heap->head = sort_by_address(heap->head);
+
+    free_block *prev = NULL;
+    free_block *block = heap->head;
+    while (block && block->next) {
+        if ((char *)block + block->size + sizeof(free_block) == (char *)block->next) {
+            block->size += block->next->size + sizeof(free_block);
+            block->next = block->next->next;
+        }
+        else {
+            prev = block;
+            block = block->next;
+        }
+    }
+
+    if (heap == &MAIN_HEAP && block && (char *)block + block->size + sizeof(free_block) == (char *)sbrk(0)) {
+        if (prev) {
+            prev->next = NULL;
+        }
+        else {
+            heap->head = NULL;
+        }
+        size_t release = block->size + sizeof(free_block);     //read before the block is given back
+        sbrk(-(intptr_t)release);
+        track_break();
+    }
+}
+
+/**
+ * Aligned allocation from a heap
+ *
+ * Over-allocates, then gives the unused space in front of and behind the
+ * aligned block back to the free list so it can be freed as usual.
+ *
+ * @param heap The heap to allocate from, locked by the caller
+ * @param alignment The required alignment, a power of two above ALIGNMENT
+ * @param size The amount of memory to allocate, already aligned
+ * @return A pointer to the aligned block of memory, or NULL
+ */
+void *memalign_locked(tuheap *heap, size_t alignment, size_t size) {
+    char *raw = alloc_locked(heap, size + alignment + sizeof(free_block));
+    if (!raw) {
+        return NULL;
+    }
+
+    free_block *block = (free_block *)raw - 1;
+    char *aligned = (char *)(((uintptr_t)raw + alignment - 1) & ~((uintptr_t)alignment - 1));
+    if (aligned != raw) {
+        // aligned - raw is a non-zero multiple of ALIGNMENT, so the leading block has room for its header
+        free_block *front = block;
+        block = (free_block *)aligned - 1;
+        block->size = front->size - (size_t)(aligned - raw);
+        block->next = NULL;
+        front->size = (size_t)((char *)block - raw);
+        free_locked(heap, raw);
+    }
+
+    // Give back the tail if it is big enough to be a block of its own
+    if (block->size >= size + 2 * sizeof(free_block)) {
+        split(block, size);
+        free_locked(heap, (char *)block + 2 * sizeof(free_block) + size);
+    }
+
+    return aligned;
+}
+
+/**
+ * Return the oldest blocks of a thread-cache bin to their slabs or the main heap
+ *
+ * @param bin The bin to trim, the main heap lock held by the caller
+ * @param keep How many of the most recently cached blocks to keep
+ */
+static void tcache_flush_bin(tu_tcache_bin *bin, unsigned int keep) {
+    void *rest = bin->head;
+    if (keep == 0) {
+        bin->head = NULL;
+    }
+    else {
+        void *last = bin->head;
+        for (unsigned int i = 1; i < keep && last; i++) {
+            last = *(void **)last;
+        }
+        if (!last) {
+            return;
+        }
+        rest = *(void **)last;
+        *(void **)last = NULL;
+    }
+
+    while (rest) {
+        void *next = *(void **)rest;
+        TU_PREFETCH_ADDR(next);
+        release_locked(rest);
+        rest = next;
+    }
+    bin->count = keep < bin->count ? keep : bin->count;
+}
+
+/**
+ * Halve every bin of the calling thread's cache if the maintenance thread asked for it
+ *
+ * Another thread can't touch this cache, so the request is picked up here,
+ * on a path that already holds the main heap lock.
+ */
+static void tcache_trim_locked(void) {
+    unsigned long gen = __atomic_load_n(&TRIM_GEN, __ATOMIC_RELAXED);
+    if (tu_tcache_tls.trim_gen == gen) {
+        return;
+    }
+    tu_tcache_tls.trim_gen = gen;
+    for (size_t cls = 0; cls < TU_NUM_CLASSES; cls++) {
+        tcache_flush_bin(&tu_tcache_tls.bins[cls], tu_tcache_tls.bins[cls].count / 2);
+    }
+}
+
+/**
+ * Give memory back after the heap grew past a limit
+ *
+ * Frees every tufree_deferred queue and this thread's whole cache, asks the
+ * other threads to halve theirs, releases empty slabs, merges the free
+ * list, trims the top of the heap and purges the pages of large free
+ * blocks. Runs on the allocating thread at the start of a slow path, where
+ * nothing is half done; growing only raises the flag.
+ *
+ * @return 1 if there was pressure to relieve, 0 otherwise
+ */
+static int relieve_locked(void) {
+    if (!LIMITS.pressure) {
+        return 0;
+    }
+    LIMITS.pressure = 0;
+
+    defer_drain_all_locked();
+    for (size_t cls = 0; cls < TU_NUM_CLASSES; cls++) {
+        tcache_flush_bin(&tu_tcache_tls.bins[cls], 0);
+    }
+    __atomic_fetch_add(&TRIM_GEN, 1, __ATOMIC_RELAXED);
+    slab_release_empty();
+    consolidate_locked(&MAIN_HEAP);
+    purge_locked();
+    return 1;
+}
+
+/**
+ * Last resort before an allocation fails, one step per call
+ *
+ * The first step runs the pressure handlers with the heap lock dropped, as
+ * they will free memory, then reclaims what they freed as under a soft
+ * limit. The next step puts the emergency reserve on the free list.
+ * Handlers are skipped while the thread is already running them, or is
+ * allocating under one of the allocator's own locks (see pressure_hold).
+ *
+ * @param size The request that could not be met
+ * @param step Where to resume, 0 on the first call; advanced by the call
+ * @return 1 if something was tried and the allocation is worth retrying, 0 once nothing is left
+ */
+static int rescue_locked(size_t size, int *step) {
+    tu_tcache *tcache = &tu_tcache_tls;
+    if (*step == 0) {
+        *step = 1;
+        if (PRESSURE.count && !tcache->no_pressure) {
+            tu_pressure_fn fns[PRESSURE_HANDLERS];
+            void *args[PRESSURE_HANDLERS];
+            size_t count = PRESSURE.count;
+            memcpy(fns, PRESSURE.fns, count * sizeof(fns[0]));
+            memcpy(args, PRESSURE.args, count * sizeof(args[0]));
+
+            tcache->no_pressure++;
+            pthread_mutex_unlock(&MAIN_HEAP.lock);
+            for (size_t i = 0; i < count; i++) {
+                fns[i](size, args[i]);
+            }
+            pthread_mutex_lock(&MAIN_HEAP.lock);
+            tcache->no_pressure--;
+
+            LIMITS.pressure = 1;
+            relieve_locked();
+            return 1;
+        }
+    }
+    if (*step == 1) {
+        *step = 2;
+        if (PRESSURE.reserve) {
+            // Push it without merging, which could trim its touched pages off the top
+            int defer = MAIN_HEAP.defer;
+            MAIN_HEAP.defer = 1;
+            free_locked(&MAIN_HEAP, PRESSURE.reserve);
+            MAIN_HEAP.defer = defer;
+            PRESSURE.reserve = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Thread exit: give the whole cache back to the main heap
+ *
+ * @param arg The exiting thread's cache
+ */
+static void tcache_destroy(void *arg) {
+    tu_tcache *tcache = arg;
+
+    epoch_thread_exit(tcache);
+    defer_thread_exit(tcache);
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    for (size_t cls = 0; cls < TU_NUM_CLASSES; cls++) {
+        tcache_flush_bin(&tcache->bins[cls], 0);
+    }
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    tcache->registered = 0;
+}
+
+/**
+ * Make sure the calling thread's cache gets flushed when it exits
+ */
+void tcache_register(void) {
+    if (!tu_tcache_tls.registered) {
+        tu_tcache_tls.registered = 1;
+        pthread_setspecific(TCACHE_KEY, &tu_tcache_tls);
+    }
+}
+
+/**
+ * Large allocation from the main heap: a span of pages if the size has one, else the free list
+ *
+ * @param size The amount of memory to allocate, already aligned; main heap lock held by the caller
+ * @return A pointer to the requested block of memory, or NULL
+ */
+static void *alloc_large_locked(size_t size) {
+    void *ptr = span_alloc(size);
+    return ptr ? ptr : alloc_locked(&MAIN_HEAP, size);
+}
+
+/**
+ * Allocation miss path: large requests, or a small request whose bin is empty
+ *
+ * Large requests of a few pages come from a span of the page heap, bigger
+ * ones from the free list. An empty bin is refilled with up to one slab's
+ * worth of blocks (capped at the bin size) under a single lock.
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+void *tumalloc_slow(size_t size) {
+    if (size == 0 || size > MAX_ALLOC) {
+        return NULL;
+    }
+
+    if (size > TU_SMALL_MAX) {
+        pthread_mutex_lock(&MAIN_HEAP.lock);
+        relieve_locked();
+        void *ptr = alloc_large_locked(ALIGN_UP(size));
+        if (!ptr && relieve_locked()) {
+            ptr = alloc_large_locked(ALIGN_UP(size));
+        }
+        for (int step = 0; !ptr && rescue_locked(size, &step); ) {
+            ptr = alloc_large_locked(ALIGN_UP(size));
+        }
+        pthread_mutex_unlock(&MAIN_HEAP.lock);
+        return ptr;
+    }
+
+    size_t cls = tu_size_class(size);
+    tu_tcache_bin *bin = &tu_tcache_tls.bins[cls];
+    tcache_register();
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    relieve_locked();
+    tcache_trim_locked();
+    size_t want = TUNING.tcache_fill > bin->count ? TUNING.tcache_fill - bin->count : 1;
+    if (!slab_refill(cls, bin, want) && !(relieve_locked() && slab_refill(cls, bin, want))) {
+        // No page for a new slab, try the free list for just the one block
+        void *ptr = alloc_locked(&MAIN_HEAP, tu_class_size(cls));
+        for (int step = 0; !ptr && rescue_locked(size, &step); ) {
+            if (slab_refill(cls, bin, want)) {
+                break;
+            }
+            ptr = alloc_locked(&MAIN_HEAP, tu_class_size(cls));
+        }
+        if (ptr || !bin->count) {
+            pthread_mutex_unlock(&MAIN_HEAP.lock);
+            return ptr;
+        }
+    }
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+
+    void *ptr = bin->head;
+    bin->head = *(void **)ptr;
+    bin->count--;
+    TU_PREFETCH_ADDR(bin->head);
+    return ptr;
+}
+
+/**
+ * Allocates memory close to an existing block
+ *
+ * For building linked structures in address order: small requests first
+ * look for a cached block on the hint's page, then for a free block in the
+ * hint's slab (or another slab on its chunk). Large requests ignore the
+ * hint: they cover whole pages of their own, and come from spans or the
+ * free list as with tumalloc. Anything else falls back to tumalloc too.
+ *
+ * @param hint A live block from tumalloc and friends, any pointer outside the main heap's page heap, or NULL
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+void *tumalloc_near(void *hint, size_t size) {
+    if (!hint || size - 1 >= TU_SMALL_MAX) {
+        return tumalloc(size);
+    }
+
+    size_t cls = tu_size_class(size);
+    tu_tcache_bin *bin = &tu_tcache_tls.bins[cls];
+    void **link = &bin->head;
+    for (int i = 0; i < NEAR_CACHE_SCAN && *link; i++, link = (void **)*link) {
+        if ((uintptr_t)*link / TU_PAGE_SIZE == (uintptr_t)hint / TU_PAGE_SIZE) {
+            void *ptr = *link;
+            *link = *(void **)ptr;
+            bin->count--;
+            TU_PREFETCH_ADDR(bin->head);
+            return ptr;
+        }
+    }
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    void *ptr = slab_alloc_near(cls, hint);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return ptr ? ptr : tumalloc(size);
 }
 
 /**
@@ -217,7 +750,7 @@ void *tucalloc(size_t num, size_t size) {
     if(!block) {
         return NULL;
     }
-    memset(block, 0, size);
+    tu_memzero(block, num * size);
     return block;
 }
 
@@ -247,7 +780,7 @@ void *turealloc(void *ptr, size_t new_size) {
     }
 
     else {
-        memcpy(redo, ptr, new_size < header->size ? new_size : header->size);       //copies memory to redo, from pointer, with the bytes specified to copy to the new reallocated piece of memory
+        tu_memcopy(redo, ptr, new_size < header->size ? new_size : header->size);       //copies memory to redo, from pointer, with the bytes specified to copy to the new reallocated piece of memory
         tufree(ptr);                    //free the previous piece of allocated memory
     }
 
@@ -255,39 +788,519 @@ void *turealloc(void *ptr, size_t new_size) {
 }
 
 /**
- * Removes used chunk of memory and returns it to the free list
+ * Free miss path: large blocks, or a small block whose bin is full
+ *
+ * A full bin sends its TCACHE_BATCH oldest blocks back to the heap under one
+ * lock and then caches ptr.
  *
  * @param ptr Pointer to the allocated piece of memory
+ * @param cls The block's size class, TU_NUM_CLASSES for large blocks
  */
-void tufree(void *ptr) {
-    void *programbreak;             //end of the heap
-    free_block *tmp = (free_block *)((char *)ptr - sizeof(free_block));     //temporary pointer
-
+void tufree_slow(void *ptr, size_t cls) {
     if(!ptr) {              //if no valid input, break from the function
         return;
     }
 
-    programbreak = sbrk(0);     //assign to end of heap
-    if ((char *)tmp+ tmp->size + sizeof(free_block) == programbreak) {      //check that the memory we're deallocating is at the end of the heap
-        if(HEAD == tmp) {       //check that tmp is not already the HEAD
-            HEAD = NULL;
-        }
-        else {
-           free_block *prev_pointer = find_prev(tmp);       //find the previous node in the free list
-           if(prev_pointer) {                               //if there is one,
-                prev_pointer->next = NULL;                  //break the reference of the previous node to tmp
-           }
+    if (cls >= TU_NUM_CLASSES) {
+        pthread_mutex_lock(&MAIN_HEAP.lock);
+        release_locked(ptr);
+        pthread_mutex_unlock(&MAIN_HEAP.lock);
+        return;
+    }
+
+    tcache_register();
+    tu_tcache_bin *bin = &tu_tcache_tls.bins[cls];
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    tcache_flush_bin(bin, TUNING.tcache_fill > TCACHE_BATCH ? TUNING.tcache_fill - TCACHE_BATCH : 0);
+    tcache_trim_locked();
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+
+    *(void **)ptr = bin->head;
+    bin->head = ptr;
+    bin->count++;
+}
+
+/**
+ * Allocates memory whose address is a multiple of alignment
+ *
+ * @param alignment The required alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the aligned block of memory, or NULL
+ */
+void *tumemalign(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return tumalloc(size);
+    }
+    if ((alignment & (alignment - 1)) != 0 || size == 0 || size > MAX_ALLOC || alignment > MAX_ALLOC) {
+        return NULL;
+    }
+    if (size <= TU_SMALL_MAX) {
+        // Small blocks may end up in a thread cache, which sorts them by class
+        size = tu_class_size(tu_size_class(size));
+    }
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    relieve_locked();
+    void *ptr = memalign_locked(&MAIN_HEAP, alignment, ALIGN_UP(size));
+    if (!ptr && relieve_locked()) {
+        ptr = memalign_locked(&MAIN_HEAP, alignment, ALIGN_UP(size));
+    }
+    for (int step = 0; !ptr && rescue_locked(size, &step); ) {
+        ptr = memalign_locked(&MAIN_HEAP, alignment, ALIGN_UP(size));
+    }
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return ptr;
+}
+
+/**
+ * Sets the main heap's memory limits
+ *
+ * Limits apply to the heap's footprint, how far the break stands past
+ * where it was before the heap first grew. Past the soft limit, the next allocation that
+ * takes the heap lock first flushes caches and queues, trims the heap and
+ * purges large free blocks (see relieve_locked). The heap never grows past
+ * the hard limit: an allocation that would need to does the same and tries
+ * again, then returns NULL. Memory already in a thread cache can still be
+ * handed out.
+ *
+ * @param soft Footprint in bytes that starts reclaiming, 0 for none
+ * @param hard Footprint in bytes never exceeded, 0 for none
+ * @return 0 on success, -1 if soft is above hard
+ */
+int tumalloc_set_limits(size_t soft, size_t hard) {
+    if (hard && soft > hard) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    LIMITS.soft = soft;
+    LIMITS.hard = hard;
+    LIMITS.pressure = (soft && LIMITS.footprint > soft) || (hard && LIMITS.footprint > hard);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return 0;
+}
+
+/**
+ * Make the next slow path give memory back, as if a limit had been crossed
+ *
+ * Main heap lock held by the caller.
+ */
+void limits_press_locked(void) {
+    LIMITS.pressure = 1;
+}
+
+/**
+ * Reports the main heap's footprint
+ *
+ * @return Bytes the break stands past where it was before the heap first grew
+ */
+size_t tumalloc_footprint(void) {
+    return __atomic_load_n(&LIMITS.footprint, __ATOMIC_RELAXED);
+}
+
+/**
+ * Registers a handler to run before an allocation fails
+ *
+ * When the heap cannot grow (sbrk fails or the hard limit is reached) and
+ * reclaiming did not help, every handler runs once, in registration order,
+ * on the failing thread and without the heap lock held. Handlers should
+ * free what they can; what they free is reclaimed before the allocation is
+ * retried. Only if that fails too is the emergency reserve spent.
+ *
+ * @param fn The handler
+ * @param arg Passed to the handler
+ * @return 0 on success, -1 if PRESSURE_HANDLERS are already registered
+ */
+int tumalloc_add_pressure_handler(tu_pressure_fn fn, void *arg) {
+    if (!fn) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    if (PRESSURE.count == PRESSURE_HANDLERS) {
+        pthread_mutex_unlock(&MAIN_HEAP.lock);
+        return -1;
+    }
+    PRESSURE.fns[PRESSURE.count] = fn;
+    PRESSURE.args[PRESSURE.count] = arg;
+    PRESSURE.count++;
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return 0;
+}
+
+/**
+ * Unregisters a pressure handler
+ *
+ * A failing allocation that already started running handlers may still call it once.
+ *
+ * @param fn The handler
+ * @param arg The argument it was registered with
+ * @return 0 on success, -1 if it was not registered
+ */
+int tumalloc_remove_pressure_handler(tu_pressure_fn fn, void *arg) {
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    for (size_t i = 0; i < PRESSURE.count; i++) {
+        if (PRESSURE.fns[i] == fn && PRESSURE.args[i] == arg) {
+            PRESSURE.count--;
+            memmove(&PRESSURE.fns[i], &PRESSURE.fns[i + 1], (PRESSURE.count - i) * sizeof(PRESSURE.fns[0]));
+            memmove(&PRESSURE.args[i], &PRESSURE.args[i + 1], (PRESSURE.count - i) * sizeof(PRESSURE.args[0]));
+            pthread_mutex_unlock(&MAIN_HEAP.lock);
+            return 0;
         }
-        sbrk(-(tmp->size + sizeof(free_block)));            //deallocate memory based on the total size of tmp
     }
-    else {
-        if(HEAD == NULL || HEAD->next == NULL) {            
-            tmp->next = NULL;
-            HEAD = tmp;
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return -1;
+}
+
+/**
+ * Sets aside an emergency reserve for the first allocation that would fail
+ *
+ * The reserve is taken from the heap now, and its pages are touched so they
+ * are really there. When an allocation fails even after the pressure
+ * handlers ran, the reserve goes back to the heap and the allocation is
+ * retried, so the process can finish what it is doing and shed load. Check
+ * tumalloc_reserve to see whether it has been spent, and call this again to
+ * set a new one once things have calmed down. Any reserve already held is
+ * given back first.
+ *
+ * @param size Bytes to hold back, 0 to drop the reserve
+ * @return 0 on success, -1 if the memory could not be had (no reserve is held then)
+ */
+int tumalloc_set_reserve(size_t size) {
+    if (size > MAX_ALLOC) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    if (PRESSURE.reserve) {
+        free_locked(&MAIN_HEAP, PRESSURE.reserve);
+        PRESSURE.reserve = NULL;
+    }
+    void *reserve = size ? alloc_locked(&MAIN_HEAP, ALIGN_UP(size)) : NULL;
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    if (size && !reserve) {
+        return -1;
+    }
+
+    if (reserve) {
+        memset(reserve, 0, size);
+    }
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    if (PRESSURE.reserve) {
+        free_locked(&MAIN_HEAP, PRESSURE.reserve);     // another call set one meanwhile
+    }
+    PRESSURE.reserve = reserve;
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return 0;
+}
+
+/**
+ * Reports the emergency reserve still held
+ *
+ * @return Usable bytes in the reserve, 0 if none was set or it has been spent
+ */
+size_t tumalloc_reserve(void) {
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    size_t size = PRESSURE.reserve ? ((free_block *)PRESSURE.reserve - 1)->size : 0;
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return size;
+}
+
+/**
+ * Clear tumalloc_group's output when it fails, so no layout offsets pass for addresses
+ *
+ * @param n How many objects
+ * @param out_ptrs The caller's output array
+ * @return NULL
+ */
+static void *group_fail(size_t n, void **out_ptrs) {
+    for (size_t i = 0; i < n; i++) {
+        out_ptrs[i] = NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Allocates several objects back to back in one block
+ *
+ * Objects are laid out in order, each at the next offset that satisfies its
+ * alignment, so they share one header and sit in adjacent cache lines. The
+ * whole group is released at once with tufree on the returned pointer,
+ * which is also out_ptrs[0].
+ *
+ * @param n How many objects
+ * @param sizes Size of each object
+ * @param aligns Alignment of each object, a power of two, or NULL (or 0 entries) for ALIGNMENT
+ * @param out_ptrs Filled in with each object's address, or with NULL if the call fails
+ * @return The group's block, or NULL
+ */
+void *tumalloc_group(size_t n, const size_t *sizes, const size_t *aligns, void **out_ptrs) {
+    if (n == 0 || !sizes || !out_ptrs) {
+        return NULL;
+    }
+
+    // Lay out the objects relative to a block aligned for the strictest one
+    size_t total = 0;
+    size_t max_align = ALIGNMENT;
+    for (size_t i = 0; i < n; i++) {
+        size_t align = aligns && aligns[i] ? aligns[i] : ALIGNMENT;
+        if ((align & (align - 1)) != 0 || align > MAX_ALLOC || sizes[i] > MAX_ALLOC) {
+            return group_fail(n, out_ptrs);
         }
-        else {
-            tmp->next = HEAD;
-            HEAD = coalesce(tmp);
+        total = (total + align - 1) & ~(align - 1);
+        out_ptrs[i] = (void *)total;
+        total += sizes[i];
+        if (total > MAX_ALLOC) {
+            return group_fail(n, out_ptrs);
+        }
+        if (align > max_align) {
+            max_align = align;
+        }
+    }
+
+    char *base = tumemalign(max_align, total ? total : 1);
+    if (!base) {
+        return group_fail(n, out_ptrs);
+    }
+    for (size_t i = 0; i < n; i++) {
+        out_ptrs[i] = base + (size_t)out_ptrs[i];
+    }
+    return base;
+}
+
+/**
+ * Allocates memory that shares no cache line with any other object
+ *
+ * The block starts on a line boundary and is padded to a whole number of
+ * lines, so the next block's header starts on a fresh line. The only other
+ * thing in the line before it is this block's own header, which is written
+ * when the block is allocated and freed but not while it is in use.
+ *
+ * @param size The amount of memory to allocate
+ * @param line The line size to isolate on, a power of two; 0 for TU_CACHE_LINE
+ * @return A pointer to the isolated block of memory, or NULL
+ */
+void *tumalloc_isolated(size_t size, size_t line) {
+    if (line == 0) {
+        line = TU_CACHE_LINE;
+    }
+    if ((line & (line - 1)) != 0 || size == 0 || size > MAX_ALLOC || line > MAX_ALLOC) {
+        return NULL;
+    }
+    size = (size + line - 1) & ~(line - 1);
+
+    // tumemalign rounds small sizes to a class; use the first class that is whole lines
+    if (size <= TU_SMALL_MAX) {
+        size_t cls = tu_size_class(size);
+        while (cls < TU_NUM_CLASSES && tu_class_size(cls) % line != 0) {
+            cls++;
         }
+        size = cls < TU_NUM_CLASSES ? tu_class_size(cls) : TU_SMALL_MAX + line;
+        size = (size + line - 1) & ~(line - 1);
+    }
+    return tumemalign(line < ALIGNMENT ? ALIGNMENT : line, size);
+}
+
+/**
+ * Reports how many bytes can actually be used in an allocated block
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ * @return The usable size of the block, 0 for NULL
+ */
+size_t tumalloc_usable_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    return ((free_block *)ptr - 1)->size;
+}
+
+/**
+ * Advises whether a live block should be moved to help release memory
+ *
+ * Says yes for small blocks in slabs that are used more sparsely than the
+ * rest of their size class: once those blocks are moved out with
+ * tumalloc_relocate, the sparse slab empties and its pages go back to the
+ * page heap. Blocks from the free list always get no.
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ * @return 1 if the block should move, 0 otherwise
+ */
+int tumalloc_should_move(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    int move = slab_should_move((free_block *)ptr - 1);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return move;
+}
+
+/**
+ * Moves a block the way tumalloc_should_move expects
+ *
+ * The new block comes straight from the class's fullest partial slabs and
+ * the old one goes straight back to its slab, both bypassing the thread
+ * cache; going through tumalloc and tufree would likely hand back a block
+ * from the same sparse slab.
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ * @return The block's new address, or ptr if it was left in place
+ */
+void *tumalloc_relocate(void *ptr) {
+    if (!ptr) {
+        return NULL;
+    }
+    free_block *old = (free_block *)ptr - 1;
+    if (!old->next || old->size > TU_SMALL_MAX) {
+        return ptr;
+    }
+
+    tu_tcache_bin fresh = { NULL, 0 };
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    if (!slab_refill(tu_size_class(old->size), &fresh, 1)) {
+        pthread_mutex_unlock(&MAIN_HEAP.lock);
+        return ptr;
+    }
+    memcpy(fresh.head, ptr, old->size);
+    slab_free_block(old);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return fresh.head;
+}
+
+/**
+ * Runs tumalloc_should_move over many blocks under one lock
+ *
+ * @param ptrs The blocks to check, NULL entries are skipped
+ * @param n How many blocks
+ * @param out Receives 1 or 0 for each block
+ * @return How many blocks should move
+ */
+size_t tumalloc_should_move_batch(void *const *ptrs, size_t n, unsigned char *out) {
+    size_t count = 0;
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = ptrs[i] ? (unsigned char)slab_should_move((free_block *)ptrs[i] - 1) : 0;
+        count += out[i];
+    }
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return count;
+}
+
+/**
+ * Creates an independent heap
+ *
+ * The heap has its own free list and lock, and borrows its memory from the
+ * main heap in chunks that all go back at once in tuheap_destroy.
+ *
+ * @return The new heap, or NULL
+ */
+tuheap *tuheap_create(void) {
+    tuheap *heap = tumalloc(sizeof(tuheap));
+    if (!heap) {
+        return NULL;
+    }
+
+    heap->head = NULL;
+    heap->chunks = NULL;
+    heap->defer = 0;
+    pthread_mutex_init(&heap->lock, NULL);
+    return heap;
+}
+
+/**
+ * Destroys a heap, releasing every block still allocated from it
+ *
+ * @param heap The heap to destroy
+ */
+void tuheap_destroy(tuheap *heap) {
+    if (!heap) {
+        return;
+    }
+
+    heap_chunk *chunk = heap->chunks;
+    while (chunk) {
+        heap_chunk *next = chunk->next;
+        tufree(chunk);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&heap->lock);
+    tufree(heap);
+}
+
+/**
+ * Allocates memory from a heap
+ *
+ * @param heap The heap to allocate from
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory, or NULL
+ */
+void *tuheap_alloc(tuheap *heap, size_t size) {
+    if (size == 0 || size > MAX_ALLOC) {
+        return NULL;
     }
+
+    pthread_mutex_lock(&heap->lock);
+    void *ptr = alloc_locked(heap, ALIGN_UP(size));
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+/**
+ * Allocates aligned memory from a heap
+ *
+ * @param heap The heap to allocate from
+ * @param alignment The required alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the aligned block of memory, or NULL
+ */
+void *tuheap_memalign(tuheap *heap, size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return tuheap_alloc(heap, size);
+    }
+    if ((alignment & (alignment - 1)) != 0 || size == 0 || size > MAX_ALLOC || alignment > MAX_ALLOC) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    void *ptr = memalign_locked(heap, alignment, ALIGN_UP(size));
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+/**
+ * Returns memory to the heap it was allocated from
+ *
+ * @param heap The heap ptr was allocated from
+ * @param ptr Pointer to the allocated piece of memory
+ */
+void tuheap_free(tuheap *heap, void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    free_locked(heap, ptr);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * Fork handlers: keep the lock consistent in the child
+ */
+static void prefork(void) {
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+}
+
+static void postfork(void) {
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+}
+
+/**
+ * Register the fork handlers and the thread-cache key once at load time
+ *
+ * Runs before the other constructors so the heap lock is taken last before
+ * a fork: the movable-space lock is held while calling into the heap.
+ */
+__attribute__((constructor(101))) static void register_fork_handlers(void) {
+    pthread_key_create(&TCACHE_KEY, tcache_destroy);
+    pthread_atfork(prefork, postfork, postfork);
 }
@@ -3,6 +3,12 @@
 
 #include <stddef.h>
 
+#include "size_classes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Header for allocated blocks
  */
@@ -19,9 +25,255 @@ typedef struct free_block {
     struct free_block *next; /**< Pointer to the next free block */
 } free_block;
 
-void *tumalloc(size_t size);
+#define TU_TCACHE_CAP 64 /**< Blocks a thread keeps per size class */
+#define TU_CACHE_LINE 64 /**< Default line size for tumalloc_isolated */
+#define TU_EPOCH_LISTS 3 /**< Retire lists a thread keeps, one per epoch still in flight */
+
+/**
+ * Prefetch for list walks and cache pops, compiled in with -DTU_PREFETCH=ON
+ */
+#ifdef TU_PREFETCH
+#define TU_PREFETCH_ADDR(p) __builtin_prefetch(p)
+#else
+#define TU_PREFETCH_ADDR(p) ((void)0)
+#endif
+
+#ifdef __cplusplus
+#define TU_THREAD_LOCAL thread_local
+#else
+#define TU_THREAD_LOCAL _Thread_local
+#endif
+
+/**
+ * One size class in a thread cache: a LIFO list of ready-to-use blocks
+ */
+typedef struct tu_tcache_bin {
+    void *head; /**< Most recently cached block */
+    unsigned int count; /**< How many blocks are cached */
+} tu_tcache_bin;
+
+/**
+ * Blocks a thread retired during one epoch
+ *
+ * Kept in an array rather than linked through the blocks, since readers may
+ * still be following pointers stored in them.
+ */
+typedef struct tu_retire_list {
+    void **blocks; /**< The retired blocks */
+    unsigned int count; /**< Blocks in the array */
+    unsigned int cap; /**< Room in the array */
+    unsigned long epoch; /**< Epoch the blocks were retired in */
+} tu_retire_list;
+
+/**
+ * Per-thread cache of small blocks, one bin per size class
+ *
+ * Cached blocks are still allocated as far as the heap is concerned; the
+ * first word of each block links them together, leaving the header alone.
+ */
+typedef struct tu_tcache {
+    tu_tcache_bin bins[TU_NUM_CLASSES]; /**< Bins indexed by size class */
+    int registered; /**< Whether thread exit will flush this cache */
+    unsigned long trim_gen; /**< TRIM_GEN when the cache was last trimmed */
+    unsigned int epoch_depth; /**< Nesting of tu_epoch_enter calls */
+    unsigned int no_pressure; /**< Nonzero while pressure handlers must not run on this thread */
+    struct tu_epoch_record *epoch; /**< This thread's entry in the epoch registry, NULL until first used */
+    struct tu_defer_queue *defer_queue; /**< This thread's tufree_deferred queue, NULL until first used */
+    tu_retire_list retire[TU_EPOCH_LISTS]; /**< Retired blocks, indexed by epoch modulo TU_EPOCH_LISTS */
+} tu_tcache;
+
+extern TU_THREAD_LOCAL tu_tcache tu_tcache_tls __attribute__((tls_model("initial-exec")));
+
+void *tumalloc_slow(size_t size);
+void tufree_slow(void *ptr, size_t cls);
+void tcache_register(void);
+
+/**
+ * Map a small request size (1..TU_SMALL_MAX) to the smallest class that fits it
+ */
+inline size_t tu_size_class(size_t size) {
+    static const unsigned char index[(TU_SMALL_MAX >> 4) + 1] = TU_CLASS_INDEX_TABLE;
+    return index[(size + 15) >> 4];
+}
+
+/**
+ * Block size of a small size class
+ */
+inline size_t tu_class_size(size_t cls) {
+    static const unsigned short sizes[TU_NUM_CLASSES] = TU_CLASS_SIZE_TABLE;
+    return sizes[cls];
+}
+
+/**
+ * Map a block size (16..TU_SMALL_MAX) to the largest class it can serve
+ */
+inline size_t tu_block_class(size_t size) {
+    size_t cls = tu_size_class(size);
+    return tu_class_size(cls) > size ? cls - 1 : cls;
+}
+
+/**
+ * Allocates memory for the end user
+ *
+ * Small requests pop a block from the thread cache; everything else, and
+ * an empty bin, goes to tumalloc_slow.
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+inline void *tumalloc(size_t size) {
+    if (size - 1 < TU_SMALL_MAX) {
+        tu_tcache_bin *bin = &tu_tcache_tls.bins[tu_size_class(size)];
+        void *ptr = bin->head;
+        if (ptr) {
+            bin->head = *(void **)ptr;
+            bin->count--;
+            TU_PREFETCH_ADDR(bin->head);
+            return ptr;
+        }
+    }
+    return tumalloc_slow(size);
+}
+
+/**
+ * Push a small block into the thread cache, spilling to the heap when the bin is full
+ *
+ * A thread that only ever frees (the consumer side of a queue) caches
+ * blocks too, so the first push registers the cache to be flushed at exit.
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ * @param cls A size class no bigger than the block
+ */
+inline void tu_tcache_push(void *ptr, size_t cls) {
+    tu_tcache_bin *bin = &tu_tcache_tls.bins[cls];
+    if (__builtin_expect(!tu_tcache_tls.registered, 0)) {
+        tcache_register();
+    }
+    if (bin->count < TU_TCACHE_CAP) {
+        *(void **)ptr = bin->head;
+        bin->head = ptr;
+        bin->count++;
+        return;
+    }
+    tufree_slow(ptr, cls);
+}
+
+/**
+ * Removes used chunk of memory and returns it to the free list
+ *
+ * Small blocks go to the thread cache; the size class comes from the header.
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ */
+inline void tufree(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    size_t size = ((free_block *)ptr - 1)->size;
+    if (size <= TU_SMALL_MAX) {
+        tu_tcache_push(ptr, tu_block_class(size));
+        return;
+    }
+    tufree_slow(ptr, TU_NUM_CLASSES);
+}
+
+/**
+ * Removes a chunk of memory whose size the caller already knows
+ *
+ * Entry point for sized deallocation such as C++ sized delete: the size class
+ * comes from the size argument, so small frees never read the header.
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ * @param size The size that was requested when ptr was allocated
+ */
+inline void tufree_sized(void *ptr, size_t size) {
+    if (ptr && size - 1 < TU_SMALL_MAX) {
+        tu_tcache_push(ptr, tu_size_class(size));
+        return;
+    }
+    tufree(ptr);
+}
+
 void *tucalloc(size_t num, size_t size);
 void *turealloc(void *ptr, size_t new_size);
-void tufree(void *ptr);
+void *tumemalign(size_t alignment, size_t size);
+void tufree_deferred(void *ptr);
+void tufree_deferred_flush(void);
+void *tumalloc_isolated(size_t size, size_t line);
+void *tumalloc_near(void *hint, size_t size);
+void *tumalloc_group(size_t n, const size_t *sizes, const size_t *aligns, void **out_ptrs);
+size_t tumalloc_usable_size(void *ptr);
+int tumalloc_should_move(void *ptr);
+size_t tumalloc_should_move_batch(void *const *ptrs, size_t n, unsigned char *out);
+void *tumalloc_relocate(void *ptr);
+int tumalloc_parallel_fill(unsigned int workers, size_t threshold);
+int tumalloc_background(unsigned int interval_ms);
+int tumalloc_set_limits(size_t soft, size_t hard);
+size_t tumalloc_footprint(void);
+
+/**
+ * Called before an allocation fails, to free memory (drop caches and such)
+ *
+ * Runs on the failing thread with no allocator lock held, so it may free
+ * anything, including with tuhandle_free, tu_retire and tuheap_free.
+ * Allocations it makes fail without running the handlers again. Handlers
+ * are skipped when the failing allocation is one the allocator makes for
+ * itself under its own locks: growing the handle table or movable space,
+ * a tuheap chunk or a retire list.
+ *
+ * @param size The request that could not be met
+ * @param arg The argument given at registration
+ */
+typedef void (*tu_pressure_fn)(size_t size, void *arg);
+
+int tumalloc_add_pressure_handler(tu_pressure_fn fn, void *arg);
+int tumalloc_remove_pressure_handler(tu_pressure_fn fn, void *arg);
+int tumalloc_set_reserve(size_t size);
+size_t tumalloc_reserve(void);
+int tumalloc_cgroup_tune(void);
+
+/**
+ * Independent heap with its own free list, memory borrowed from the main heap
+ */
+typedef struct tuheap tuheap;
+
+tuheap *tuheap_create(void);
+void tuheap_destroy(tuheap *heap);
+void *tuheap_alloc(tuheap *heap, size_t size);
+void *tuheap_memalign(tuheap *heap, size_t alignment, size_t size);
+void tuheap_free(tuheap *heap, void *ptr);
+
+/**
+ * Relocatable block in movable space, 0 for none
+ */
+typedef size_t tuhandle;
+
+tuhandle tuhandle_alloc(size_t size);
+void *tuhandle_lock(tuhandle handle);
+void tuhandle_unlock(tuhandle handle);
+size_t tuhandle_size(tuhandle handle);
+void tuhandle_free(tuhandle handle);
+int tuheap_compact(unsigned long long budget_ns);
+
+/**
+ * Epoch-based reclamation for lock-free structures
+ */
+int tu_epoch_enter(void);
+void tu_epoch_exit(void);
+int tu_retire(void *ptr);
+
+/**
+ * Bump arena: fast allocation, no individual frees, everything released by reset
+ */
+typedef struct tuarena tuarena;
+
+tuarena *tuarena_create(size_t chunk_size);
+void tuarena_destroy(tuarena *arena);
+void *tuarena_alloc(tuarena *arena, size_t size, size_t alignment);
+void tuarena_reset(tuarena *arena);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif //CYB3053_PROJECT2_ALLOC_H
@@ -0,0 +1,133 @@
+#include "alloc.h"
+
+#include <stdint.h>
+
+#define ARENA_MIN_CHUNK 4096 /**< Smallest chunk an arena asks tumalloc for */
+
+/**
+ * Header at the start of every chunk an arena takes from tumalloc
+ */
+typedef struct arena_chunk {
+    struct arena_chunk *next; /**< Previously filled chunk */
+    size_t size; /**< Usable bytes after this header */
+} arena_chunk;
+
+/**
+ * Bump arena state
+ *
+ * Not thread-safe: an arena belongs to one thread or one container at a time.
+ */
+struct tuarena {
+    arena_chunk *chunks; /**< Current chunk, linked to the ones filled before it */
+    char *cur; /**< Next free byte in the current chunk */
+    char *end; /**< End of the current chunk */
+    size_t chunk_size; /**< Default size of new chunks */
+};
+
+/**
+ * Creates an arena
+ *
+ * @param chunk_size How much memory to take from tumalloc at a time, 0 for a default
+ * @return The new arena, or NULL
+ */
+tuarena *tuarena_create(size_t chunk_size) {
+    tuarena *arena = tumalloc(sizeof(tuarena));
+    if (!arena) {
+        return NULL;
+    }
+
+    arena->chunks = NULL;
+    arena->cur = NULL;
+    arena->end = NULL;
+    arena->chunk_size = chunk_size > ARENA_MIN_CHUNK ? chunk_size : ARENA_MIN_CHUNK;
+    return arena;
+}
+
+/**
+ * Free every chunk in a list
+ *
+ * @param chunk The first chunk to free
+ */
+static void free_chunks(arena_chunk *chunk) {
+    while (chunk) {
+        arena_chunk *next = chunk->next;
+        tufree(chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * Destroys an arena and everything allocated from it
+ *
+ * @param arena The arena to destroy
+ */
+void tuarena_destroy(tuarena *arena) {
+    if (!arena) {
+        return;
+    }
+
+    free_chunks(arena->chunks);
+    tufree(arena);
+}
+
+/**
+ * Allocates from an arena by bumping a pointer
+ *
+ * @param arena The arena to allocate from
+ * @param size The amount of memory to allocate
+ * @param alignment The required alignment, a power of two (0 means 16)
+ * @return A pointer to the memory, or NULL
+ */
+void *tuarena_alloc(tuarena *arena, size_t size, size_t alignment) {
+    if (alignment == 0) {
+        alignment = 16;
+    }
+    // A new chunk needs size + alignment + a header; refuse what cannot be
+    // counted (a power of two is at most half of SIZE_MAX, so this cannot wrap)
+    if ((alignment & (alignment - 1)) != 0 || size > SIZE_MAX - alignment - sizeof(arena_chunk)) {
+        return NULL;
+    }
+
+    uintptr_t mask = (uintptr_t)alignment - 1;
+    char *ptr = (char *)(((uintptr_t)arena->cur + mask) & ~mask);
+    if (arena->cur && ptr >= arena->cur && ptr <= arena->end && size <= (size_t)(arena->end - ptr)) {
+        arena->cur = ptr + size;
+        return ptr;
+    }
+
+    // Start a new chunk, big enough for oversized requests
+    size_t need = size + alignment + sizeof(arena_chunk);
+    size_t chunk_size = need > arena->chunk_size ? need : arena->chunk_size;
+    arena_chunk *chunk = tumalloc(chunk_size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->size = tumalloc_usable_size(chunk) - sizeof(arena_chunk);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->end = (char *)(chunk + 1) + chunk->size;
+
+    ptr = (char *)(((uintptr_t)(chunk + 1) + mask) & ~mask);
+    arena->cur = ptr + size;
+    return ptr;
+}
+
+/**
+ * Releases everything allocated from an arena at once
+ *
+ * The most recent chunk is kept so a reused arena does not go back to
+ * tumalloc straight away.
+ *
+ * @param arena The arena to reset
+ */
+void tuarena_reset(tuarena *arena) {
+    arena_chunk *keep = arena->chunks;
+    if (!keep) {
+        return;
+    }
+
+    free_chunks(keep->next);
+    keep->next = NULL;
+    arena->cur = (char *)(keep + 1);
+    arena->end = arena->cur + keep->size;
+}
@@ -0,0 +1,177 @@
+#include "internal.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BG_MAX_INTERVAL_MS 60000 /**< Longest time between maintenance ticks */
+#define CGROUP_TICKS 10 /**< Ticks between reads of the cgroup's memory files */
+
+unsigned long TRIM_GEN = 0; /**< Bumped when thread caches should shrink */
+
+/**
+ * The maintenance thread and its schedule
+ */
+static struct {
+    pthread_mutex_t lock; /**< Guards everything below; taken before the heap lock */
+    pthread_cond_t wake; /**< Signalled when the interval changes */
+    unsigned int interval_ms; /**< Time between ticks, 0 once the thread should stop */
+    int running; /**< Whether the thread is alive */
+} BG = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+/**
+ * Hand the pages inside large free blocks back to the OS, keeping the address space
+ *
+ * Only whole pages past each block's header go, so the free list stays
+ * intact; the pages come back zeroed on the next touch. Free runs of the
+ * page heap, left behind by spans and slabs, go the same way. Main heap
+ * lock held by the caller.
+ */
+void purge_locked(void) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    for (free_block *block = MAIN_HEAP.head; block; block = block->next) {
+        if (block->size < TUNING.purge_min) {
+            continue;
+        }
+        uintptr_t start = ((uintptr_t)(block + 1) + page - 1) & ~(page - 1);
+        uintptr_t end = ((uintptr_t)(block + 1) + block->size) & ~(page - 1);
+        if (end > start) {
+            madvise((void *)start, end - start, MADV_DONTNEED);
+        }
+    }
+    slab_purge_pages(TUNING.purge_min);
+}
+
+/**
+ * One round of maintenance
+ *
+ * @param tick How many rounds came before this one
+ */
+static void run_tick(unsigned long tick) {
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    defer_drain_all_locked();
+    consolidate_locked(&MAIN_HEAP);
+    slab_release_empty();
+    if (tick % TUNING.purge_ticks == TUNING.purge_ticks - 1) {
+        purge_locked();
+    }
+    int trim = tick % TUNING.trim_ticks == TUNING.trim_ticks - 1;
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+
+    if (trim) {
+        __atomic_fetch_add(&TRIM_GEN, 1, __ATOMIC_RELAXED);
+    }
+    if (tick % CGROUP_TICKS == 0) {
+        tumalloc_cgroup_tune();
+    }
+}
+
+/**
+ * Maintenance thread: tick until told to stop, then hand the work back to the foreground
+ */
+static void *background_main(void *arg) {
+    (void)arg;
+    unsigned long tick = 0;
+
+    pthread_mutex_lock(&BG.lock);
+    while (BG.interval_ms) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += BG.interval_ms / 1000;
+        deadline.tv_nsec += (long)(BG.interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&BG.wake, &BG.lock, &deadline);
+        if (!BG.interval_ms) {
+            break;
+        }
+        pthread_mutex_unlock(&BG.lock);
+        run_tick(tick++);
+        pthread_mutex_lock(&BG.lock);
+    }
+
+    BG.running = 0;
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    MAIN_HEAP.defer = 0;
+    defer_drain_all_locked();
+    consolidate_locked(&MAIN_HEAP);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    pthread_mutex_unlock(&BG.lock);
+    return NULL;
+}
+
+/**
+ * Start, retune or stop background maintenance
+ *
+ * While it runs, frees to the main heap only push the block on the free
+ * list; each tick the thread frees every tufree_deferred queue, then
+ * merges neighbours and trims the top of the heap in one pass. It also
+ * releases empty slabs every tick, and every few ticks (see tu_tuning)
+ * purges the pages of large free blocks and asks thread caches to halve
+ * themselves. Its first tick reads the cgroup's memory budget, and it
+ * re-reads it every CGROUP_TICKS ticks after that. Stopping it puts
+ * coalescing back on the foreground path.
+ *
+ * @param interval_ms Time between ticks, 0 to stop
+ * @return 0 on success, -1 if the interval is out of range or the thread could not start
+ */
+int tumalloc_background(unsigned int interval_ms) {
+    if (interval_ms > BG_MAX_INTERVAL_MS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&BG.lock);
+    BG.interval_ms = interval_ms;
+    pthread_cond_signal(&BG.wake);
+    if (interval_ms && !BG.running) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, background_main, NULL);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            BG.interval_ms = 0;
+            pthread_mutex_unlock(&BG.lock);
+            return -1;
+        }
+        BG.running = 1;
+        pthread_mutex_lock(&MAIN_HEAP.lock);
+        MAIN_HEAP.defer = 1;
+        pthread_mutex_unlock(&MAIN_HEAP.lock);
+    }
+    pthread_mutex_unlock(&BG.lock);
+    return 0;
+}
+
+/**
+ * Fork handlers: the thread does not survive fork, so the child goes back
+ * to coalescing on free
+ */
+static void prefork(void) {
+    pthread_mutex_lock(&BG.lock);
+}
+
+static void postfork_parent(void) {
+    pthread_mutex_unlock(&BG.lock);
+}
+
+static void postfork_child(void) {
+    BG.interval_ms = 0;
+    BG.running = 0;
+    pthread_cond_init(&BG.wake, NULL);
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    MAIN_HEAP.defer = 0;
+    consolidate_locked(&MAIN_HEAP);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    pthread_mutex_unlock(&BG.lock);
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void) {
+    pthread_atfork(prefork, postfork_parent, postfork_child);
+}
@@ -0,0 +1,234 @@
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TU_HAVE_AVX2_KERNELS 1
+#endif
+
+#define WIDE_WORDS 4 /**< Maps shorter than this are scanned inline; the wide kernels skip this many words at a time */
+
+/**
+ * Scan state for a run search: where the current run of set bits started and how long it is
+ */
+typedef struct run_state {
+    size_t start; /**< Bit index of the first bit of the current run */
+    size_t len; /**< Length of the current run */
+} run_state;
+
+/**
+ * Feed one word into a run search
+ *
+ * @param state The run so far
+ * @param word The next word of the map
+ * @param base Bit index of the word's lowest bit
+ * @param run The run length wanted
+ * @return 1 once a long enough run has been seen
+ */
+static inline int run_step(run_state *state, uint64_t word, size_t base, size_t run) {
+    if (word == ~(uint64_t)0) {
+        if (state->len == 0) {
+            state->start = base;
+        }
+        state->len += 64;
+        return state->len >= run;
+    }
+
+    size_t bit = 0;
+    while (bit < 64) {
+        uint64_t rest = word >> bit;
+        if (rest == 0) {
+            state->len = 0;
+            return 0;
+        }
+        size_t zeros = (size_t)__builtin_ctzll(rest);
+        if (zeros) {
+            state->len = 0;
+            bit += zeros;
+            rest >>= zeros;
+        }
+        // rest has its low bit set, and zeros above the word's end
+        size_t ones = (size_t)__builtin_ctzll(~rest);
+        if (state->len == 0) {
+            state->start = base + bit;
+        }
+        state->len += ones;
+        if (state->len >= run) {
+            return 1;
+        }
+        bit += ones;
+    }
+    return 0;
+}
+
+static size_t find_set_scalar(const uint64_t *map, size_t nwords, size_t from_word) {
+    for (size_t w = from_word; w < nwords; w++) {
+        if (map[w]) {
+            return w * 64 + (size_t)__builtin_ctzll(map[w]);
+        }
+    }
+    return TU_BITMAP_NONE;
+}
+
+static size_t find_run_scalar(const uint64_t *map, size_t nwords, size_t run) {
+    run_state state = { 0, 0 };
+    for (size_t w = 0; w < nwords; w++) {
+        if (run_step(&state, map[w], w * 64, run)) {
+            return state.start;
+        }
+    }
+    return TU_BITMAP_NONE;
+}
+
+#ifdef TU_HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2,bmi")))
+static size_t find_set_avx2(const uint64_t *map, size_t nwords, size_t from_word) {
+    size_t w = from_word;
+    // Skip empty 256-bit blocks in one test each
+    for (; w + WIDE_WORDS <= nwords; w += WIDE_WORDS) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(map + w));
+        if (!_mm256_testz_si256(v, v)) {
+            break;
+        }
+    }
+    for (; w < nwords; w++) {
+        if (map[w]) {
+            return w * 64 + (size_t)_tzcnt_u64(map[w]);
+        }
+    }
+    return TU_BITMAP_NONE;
+}
+
+__attribute__((target("avx2,bmi")))
+static size_t find_run_avx2(const uint64_t *map, size_t nwords, size_t run) {
+    run_state state = { 0, 0 };
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    size_t w = 0;
+
+    for (; w + WIDE_WORDS <= nwords; w += WIDE_WORDS) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(map + w));
+        if (_mm256_testz_si256(v, v)) {
+            // 256 used bits: whatever run we had is over
+            state.len = 0;
+            continue;
+        }
+        if (_mm256_testc_si256(v, ones)) {
+            // 256 free bits
+            if (state.len == 0) {
+                state.start = w * 64;
+            }
+            state.len += 256;
+            if (state.len >= run) {
+                return state.start;
+            }
+            continue;
+        }
+        for (size_t i = 0; i < WIDE_WORDS; i++) {
+            if (run_step(&state, map[w + i], (w + i) * 64, run)) {
+                return state.start;
+            }
+        }
+    }
+    for (; w < nwords; w++) {
+        if (run_step(&state, map[w], w * 64, run)) {
+            return state.start;
+        }
+    }
+    return TU_BITMAP_NONE;
+}
+
+#endif
+
+/**
+ * Scan kernels for maps of WIDE_WORDS words and up, picked for this CPU
+ */
+typedef struct bitmap_kernels {
+    size_t (*find_set)(const uint64_t *, size_t, size_t);
+    size_t (*find_run)(const uint64_t *, size_t, size_t);
+    const char *name;
+} bitmap_kernels;
+
+static const bitmap_kernels SCALAR = { find_set_scalar, find_run_scalar, "scalar" };
+#ifdef TU_HAVE_AVX2_KERNELS
+static const bitmap_kernels AVX2 = { find_set_avx2, find_run_avx2, "avx2" };
+#endif
+
+static const bitmap_kernels *KERNELS = NULL; /**< Chosen on first use */
+
+/**
+ * Pick the kernels once with cpuid; racing first calls all pick the same ones
+ */
+static const bitmap_kernels *kernels(void) {
+    const bitmap_kernels *k = __atomic_load_n(&KERNELS, __ATOMIC_ACQUIRE);
+    if (k) {
+        return k;
+    }
+
+    k = &SCALAR;
+#ifdef TU_HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")) {
+        k = &AVX2;
+    }
+#endif
+    __atomic_store_n(&KERNELS, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+/**
+ * Find the first set bit at or after a given word
+ *
+ * @param map The bitmap
+ * @param nwords Number of 64-bit words in the map
+ * @param from_word First word to look at
+ * @return The bit index, or TU_BITMAP_NONE
+ */
+size_t tu_bitmap_find_set(const uint64_t *map, size_t nwords, size_t from_word) {
+    if (nwords < WIDE_WORDS) {
+        return find_set_scalar(map, nwords, from_word);
+    }
+    return kernels()->find_set(map, nwords, from_word);
+}
+
+/**
+ * Find the first run of consecutive set bits
+ *
+ * @param map The bitmap
+ * @param nwords Number of 64-bit words in the map
+ * @param run How many consecutive set bits are needed
+ * @return The index of the run's first bit, or TU_BITMAP_NONE
+ */
+size_t tu_bitmap_find_run(const uint64_t *map, size_t nwords, size_t run) {
+    if (run == 0) {
+        return 0;
+    }
+    if (nwords < WIDE_WORDS) {
+        return find_run_scalar(map, nwords, run);
+    }
+    return kernels()->find_run(map, nwords, run);
+}
+
+/**
+ * Set bits [start, start + len)
+ */
+void tu_bitmap_set_range(uint64_t *map, size_t start, size_t len) {
+    for (size_t i = start; i < start + len; i++) {
+        map[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+}
+
+/**
+ * Clear bits [start, start + len)
+ */
+void tu_bitmap_clear_range(uint64_t *map, size_t start, size_t len) {
+    for (size_t i = start; i < start + len; i++) {
+        map[i / 64] &= ~((uint64_t)1 << (i % 64));
+    }
+}
+
+/**
+ * Name of the wide kernels in use, for tests and debugging
+ */
+const char *tu_bitmap_impl(void) {
+    return kernels()->name;
+}
@@ -0,0 +1,24 @@
+#ifndef CYB3053_PROJECT2_BITMAP_H
+#define CYB3053_PROJECT2_BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bitmap scanning for slab slots and page runs
+ *
+ * A set bit means "free". Bits past the end of a map must be kept clear.
+ * Short maps (a slab's slots) are scanned with inline tzcnt loops. Longer
+ * ones (a span chunk's pages, up to 16 words) go to kernels picked once
+ * with cpuid, which on AVX2 skip 256 all-used or all-free bits per test.
+ */
+
+#define TU_BITMAP_NONE ((size_t)-1) /**< Returned when nothing was found */
+
+size_t tu_bitmap_find_set(const uint64_t *map, size_t nwords, size_t from_word);
+size_t tu_bitmap_find_run(const uint64_t *map, size_t nwords, size_t run);
+void tu_bitmap_set_range(uint64_t *map, size_t start, size_t len);
+void tu_bitmap_clear_range(uint64_t *map, size_t start, size_t len);
+const char *tu_bitmap_impl(void);
+
+#endif //CYB3053_PROJECT2_BITMAP_H
@@ -0,0 +1,297 @@
+#include "internal.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CG_PATH_MAX 1024 /**< Longest cgroup directory path we handle */
+#define CG_FILE_MAX 65536 /**< Most of a /proc file we read */
+#define GROW_STEP_MAX ((size_t)1024 * 1024) /**< Largest break step, with plenty of headroom */
+#define GROW_STEP_MID ((size_t)64 * 1024) /**< Break step once half the budget is used */
+
+#define TUNING_DEFAULT { 10, 10, (size_t)256 * 1024, TU_TCACHE_CAP, 0 } /**< Knobs without a cgroup budget */
+
+tu_tuning TUNING = TUNING_DEFAULT;
+
+/**
+ * Reading the cgroup files without allocating
+ *
+ * Tuning can run from inside the allocator (or under LD_PRELOAD, before
+ * anything else works), so files are read with plain system calls into
+ * these static buffers.
+ */
+static struct {
+    pthread_mutex_t lock; /**< Guards the buffers; taken before the heap lock */
+    char file[CG_FILE_MAX]; /**< Contents of the file being parsed */
+    char dir[CG_PATH_MAX]; /**< The process's cgroup directory */
+    char path[CG_PATH_MAX]; /**< Scratch for file paths */
+} CG = { PTHREAD_MUTEX_INITIALIZER, { 0 }, { 0 }, { 0 } };
+
+/**
+ * Read a whole file into CG.file
+ *
+ * @param path The file to read
+ * @return Bytes read, or -1
+ */
+static ssize_t read_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t len = 0;
+    for (;;) {
+        ssize_t got = read(fd, CG.file + len, sizeof(CG.file) - 1 - len);
+        if (got <= 0) {
+            break;
+        }
+        len += (size_t)got;
+    }
+    close(fd);
+    CG.file[len] = '\0';
+    return (ssize_t)len;
+}
+
+/**
+ * Find the process's cgroup v2 directory
+ *
+ * Joins the "0::" entry of /proc/self/cgroup onto wherever cgroup2 is
+ * mounted, so hybrid hosts and cgroup namespaces work too.
+ *
+ * @return Length of the mount point within CG.dir, or 0 without cgroup v2
+ */
+static size_t find_dir(void) {
+    char cgroup[CG_PATH_MAX];
+    if (read_file("/proc/self/cgroup") < 0) {
+        return 0;
+    }
+    const char *line = CG.file;
+    while (line && strncmp(line, "0::", 3) != 0) {
+        line = strchr(line, '\n');
+        line = line ? line + 1 : NULL;
+    }
+    if (!line) {
+        return 0;
+    }
+    size_t len = strcspn(line + 3, "\n");
+    if (len >= sizeof(cgroup)) {
+        return 0;
+    }
+    memcpy(cgroup, line + 3, len);
+    cgroup[len] = '\0';
+
+    // mountinfo: id parent major:minor root mount-point options ... - fstype source options
+    if (read_file("/proc/self/mountinfo") < 0) {
+        return 0;
+    }
+    for (char *entry = CG.file; *entry; ) {
+        char *end = entry + strcspn(entry, "\n");
+        char *next = *end ? end + 1 : end;
+        *end = '\0';
+
+        char *fstype = strstr(entry, " - cgroup2 ");
+        char *fields[5];
+        size_t nfields = 0;
+        for (char *f = entry; fstype && nfields < 5 && f < fstype; nfields++) {
+            fields[nfields] = f;
+            f += strcspn(f, " ");
+            *f++ = '\0';
+        }
+        if (fstype && nfields == 5) {
+            const char *root = fields[3];
+            const char *mount = fields[4];
+            size_t root_len = strlen(root);
+            const char *rel = cgroup;
+            if (strcmp(root, "/") != 0 && strncmp(cgroup, root, root_len) == 0) {
+                rel = cgroup + root_len;
+            }
+            size_t mount_len = strlen(mount);
+            if (strcmp(rel, "/") == 0) {
+                rel = "";
+            }
+            if (mount_len + strlen(rel) >= sizeof(CG.dir)) {
+                return 0;
+            }
+            memcpy(CG.dir, mount, mount_len);
+            strcpy(CG.dir + mount_len, rel);
+            return mount_len;
+        }
+        entry = next;
+    }
+    return 0;
+}
+
+/**
+ * Read a byte count from a file in a cgroup directory
+ *
+ * @param dir The directory
+ * @param name The file
+ * @param value Set to the count, or SIZE_MAX for "max"
+ * @return 0, or -1 if the file is missing or unreadable
+ */
+static int read_bytes(const char *dir, const char *name, size_t *value) {
+    size_t dir_len = strlen(dir);
+    if (dir_len + 1 + strlen(name) >= sizeof(CG.path)) {
+        return -1;
+    }
+    memcpy(CG.path, dir, dir_len);
+    CG.path[dir_len] = '/';
+    strcpy(CG.path + dir_len + 1, name);
+    if (read_file(CG.path) <= 0) {
+        return -1;
+    }
+
+    // One value, then only the newline: anything else is not ours to guess at
+    const char *c = CG.file;
+    size_t n = 0;
+    if (strncmp(c, "max", 3) == 0) {
+        n = SIZE_MAX;
+        c += 3;
+    } else if (*c < '0' || *c > '9') {
+        return -1;
+    }
+    for (; *c >= '0' && *c <= '9'; c++) {
+        size_t digit = (size_t)(*c - '0');
+        if (n > (SIZE_MAX - digit) / 10) {
+            return -1;
+        }
+        n = n * 10 + digit;
+    }
+    if (*c == '\n') {
+        c++;
+    }
+    if (*c != '\0') {
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+/**
+ * Pick knobs for how much of the budget is in use
+ *
+ * @param budget The tightest memory.max or memory.high on the way to the root
+ * @param current The cgroup's memory.current
+ * @param tuning Filled in with the knobs
+ * @return 1 if memory should be given back right away, 0 otherwise
+ */
+static int choose(size_t budget, size_t current, tu_tuning *tuning) {
+    size_t headroom = budget > current ? budget - current : 0;
+    size_t used = current / (budget / 100 ? budget / 100 : 1);
+
+    if (used < 50) {
+        // Plenty left: cache freely and grow the break in big steps
+        size_t step = headroom / 256 < GROW_STEP_MAX ? headroom / 256 : GROW_STEP_MAX;
+        *tuning = (tu_tuning){ 10, 10, (size_t)256 * 1024, TU_TCACHE_CAP, step & ~((size_t)TU_PAGE_SIZE - 1) };
+        return 0;
+    }
+    if (used < 80) {
+        *tuning = (tu_tuning){ 3, 3, (size_t)64 * 1024, TU_TCACHE_CAP / 2, headroom / 64 < GROW_STEP_MID ? 0 : GROW_STEP_MID };
+        return 0;
+    }
+    // Close to the limit: purge every tick, keep caches small, grow by exactly what is needed
+    *tuning = (tu_tuning){ 1, 1, (size_t)4 * TU_PAGE_SIZE, TU_TCACHE_CAP / 8, 0 };
+    return 1;
+}
+
+/**
+ * Tune to the budget of CG.dir and its ancestors, with CG.lock held
+ *
+ * @param mount_len Length of the mount point within CG.dir, where the walk
+ *     up stops; 0 if there is no directory
+ * @return 0 if a budget was found and applied, -1 if there is none (the defaults are applied)
+ */
+static int tune_locked(size_t mount_len) {
+    size_t budget = SIZE_MAX;
+    size_t current = 0;
+    if (mount_len && read_bytes(CG.dir, "memory.current", &current) == 0) {
+        // Every ancestor's limit applies too, up to the mount point (a
+        // namespace's root cgroup has limits; the real root has none)
+        for (size_t len = strlen(CG.dir); ; ) {
+            size_t value;
+            if (read_bytes(CG.dir, "memory.max", &value) == 0 && value < budget) {
+                budget = value;
+            }
+            if (read_bytes(CG.dir, "memory.high", &value) == 0 && value < budget) {
+                budget = value;
+            }
+            if (len <= mount_len) {
+                break;
+            }
+            while (len > mount_len && CG.dir[len] != '/') {
+                len--;
+            }
+            CG.dir[len] = '\0';
+        }
+    }
+
+    tu_tuning tuning = TUNING_DEFAULT;
+    int press = budget != SIZE_MAX && choose(budget, current, &tuning);
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    TUNING = tuning;
+    if (press) {
+        limits_press_locked();
+    }
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    return budget != SIZE_MAX ? 0 : -1;
+}
+
+/**
+ * Tune to the budget of a given cgroup directory and its ancestors
+ *
+ * What tumalloc_cgroup_tune does once it has found the process's
+ * directory. Missing, unreadable and malformed files are skipped; without
+ * memory.current in dir there is no budget.
+ *
+ * @param dir The cgroup's directory
+ * @param mount_len Length of the cgroup2 mount point within dir, where the walk up stops
+ * @return 0 if a budget was found and applied, -1 if there is none (the defaults are applied)
+ */
+int cgroup_tune_dir(const char *dir, size_t mount_len) {
+    size_t len = strlen(dir);
+    if (len >= sizeof(CG.dir) || mount_len > len) {
+        return -1;
+    }
+    pthread_mutex_lock(&CG.lock);
+    memcpy(CG.dir, dir, len + 1);
+    int ret = tune_locked(mount_len);
+    pthread_mutex_unlock(&CG.lock);
+    return ret;
+}
+
+/**
+ * Tunes the allocator to the container's cgroup v2 memory budget
+ *
+ * Reads memory.max and memory.high of the process's cgroup and its
+ * ancestors, and memory.current of the cgroup, then sets how often and how
+ * deep the maintenance thread purges, how full thread caches get and how
+ * far the main heap moves the break at a time. Past 80% of the budget the
+ * next slow path also gives memory back as under a soft limit. Nothing is
+ * read at startup: tumalloc_background runs it on its first tick and
+ * periodically after; call it yourself otherwise.
+ *
+ * @return 0 if a budget was found and applied, -1 if there is none (the defaults are kept)
+ */
+int tumalloc_cgroup_tune(void) {
+    pthread_mutex_lock(&CG.lock);
+    int ret = tune_locked(find_dir());
+    pthread_mutex_unlock(&CG.lock);
+    return ret;
+}
+
+/**
+ * Fork handlers: keep the buffer lock consistent in the child
+ */
+static void prefork(void) {
+    pthread_mutex_lock(&CG.lock);
+}
+
+static void postfork(void) {
+    pthread_mutex_unlock(&CG.lock);
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void) {
+    pthread_atfork(prefork, postfork, postfork);
+}
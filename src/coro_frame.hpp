@@ -0,0 +1,140 @@
+#ifndef CYB3053_PROJECT2_CORO_FRAME_HPP
+#define CYB3053_PROJECT2_CORO_FRAME_HPP
+
+#include "alloc.h"
+
+#include <cstddef>
+#include <new>
+
+namespace tu {
+
+/**
+ * Per-thread cache of coroutine frames, bucketed by frame size
+ *
+ * Frames up to max_cached_frame bytes are rounded to a bucket and recycled
+ * LIFO, so a freshly destroyed frame (still warm in cache) is the next one
+ * handed out. Bigger frames and overflow go straight to tumalloc.
+ */
+class frame_cache {
+public:
+    /** Bucket granularity */
+    static constexpr std::size_t granularity = 64;
+    /** Largest frame that gets cached */
+    static constexpr std::size_t max_cached_frame = 4096;
+    /** Frames kept per bucket before they go back to the heap */
+    static constexpr std::size_t max_per_bucket = 64;
+
+    frame_cache() noexcept = default;
+
+    frame_cache(const frame_cache &) = delete;
+    frame_cache &operator=(const frame_cache &) = delete;
+
+    ~frame_cache() {
+        for (bucket &b : buckets_) {
+            while (b.head) {
+                cached_frame *next = b.head->next;
+                tufree(b.head);
+                b.head = next;
+            }
+            b.count = 0;
+        }
+    }
+
+    /**
+     * The calling thread's cache
+     */
+    static frame_cache &local() noexcept {
+        static thread_local frame_cache cache;
+        return cache;
+    }
+
+    /**
+     * Get memory for a frame of the given size
+     *
+     * @return The frame, or nullptr when the heap is exhausted
+     */
+    void *allocate(std::size_t size) noexcept {
+        if (size > max_cached_frame) {
+            return tumalloc(size);
+        }
+
+        bucket &b = buckets_[index(size)];
+        if (b.head) {
+            cached_frame *frame = b.head;
+            b.head = frame->next;
+            b.count--;
+            return frame;
+        }
+        return tumalloc(bucket_size(size));
+    }
+
+    /**
+     * Give back the memory of a frame of the given size
+     */
+    void deallocate(void *ptr, std::size_t size) noexcept {
+        if (size > max_cached_frame) {
+            tufree_sized(ptr, size);
+            return;
+        }
+
+        bucket &b = buckets_[index(size)];
+        if (b.count == max_per_bucket) {
+            tufree_sized(ptr, bucket_size(size));
+            return;
+        }
+        cached_frame *frame = static_cast<cached_frame *>(ptr);
+        frame->next = b.head;
+        b.head = frame;
+        b.count++;
+    }
+
+private:
+    /**
+     * A cached frame, linked through its own storage
+     */
+    struct cached_frame {
+        cached_frame *next;
+    };
+
+    /**
+     * LIFO list of frames of one size
+     */
+    struct bucket {
+        cached_frame *head = nullptr;
+        std::size_t count = 0;
+    };
+
+    static constexpr std::size_t index(std::size_t size) noexcept {
+        return size ? (size - 1) / granularity : 0;
+    }
+
+    static constexpr std::size_t bucket_size(std::size_t size) noexcept {
+        return (index(size) + 1) * granularity;
+    }
+
+    bucket buckets_[max_cached_frame / granularity];
+};
+
+/**
+ * Mixin for coroutine promise types: frames come from the thread's frame_cache
+ *
+ * Usage: struct promise_type : tu::frame_allocated { ... };
+ * Frames freed on another thread land in that thread's cache.
+ */
+struct frame_allocated {
+    static void *operator new(std::size_t size) {
+        void *ptr = frame_cache::local().allocate(size);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    static void operator delete(void *ptr, std::size_t size) noexcept {
+        frame_cache::local().deallocate(ptr, size);
+    }
+};
+
+} // namespace tu
+
+#endif //CYB3053_PROJECT2_CORO_FRAME_HPP
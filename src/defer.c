@@ -0,0 +1,205 @@
+#include "internal.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define DEFER_BATCH 256 /**< Queued blocks a thread drains itself when no maintenance thread runs */
+#define DEFER_MAX 16384 /**< Queued blocks a thread drains itself even when the maintenance thread runs */
+
+/**
+ * A thread's queue of deferred frees
+ *
+ * Only the owner pushes; the owner or the maintenance thread drains the
+ * whole queue at once by swapping the head out. Queues are never freed; an
+ * exited thread's queue is picked up by the next new thread.
+ */
+typedef struct tu_defer_queue {
+    struct tu_defer_queue *next; /**< Next queue in the registry */
+    void *head; /**< Most recently queued block, linked through its first word; atomic */
+    size_t count; /**< Blocks queued since the last drain, roughly; atomic */
+    int in_use; /**< Whether a thread owns the queue; atomic */
+} defer_queue;
+
+static defer_queue *QUEUES = NULL; /**< Every queue ever made, only ever pushed to; atomic */
+
+/**
+ * Give the calling thread a queue, reusing one an exited thread left behind
+ *
+ * @param tcache The calling thread's cache
+ * @return The queue, or NULL
+ */
+static defer_queue *queue_acquire(tu_tcache *tcache) {
+    defer_queue *queue = __atomic_load_n(&QUEUES, __ATOMIC_ACQUIRE);
+    for (; queue; queue = queue->next) {
+        int unused = 0;
+        if (!__atomic_load_n(&queue->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&queue->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (!queue) {
+        queue = tumalloc(sizeof(defer_queue));
+        if (!queue) {
+            return NULL;
+        }
+        queue->head = NULL;
+        queue->count = 0;
+        queue->in_use = 1;
+        queue->next = __atomic_load_n(&QUEUES, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&QUEUES, &queue->next, queue, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    tcache->defer_queue = queue;
+    tcache_register();
+    return queue;
+}
+
+/**
+ * Free everything on a queue; main heap lock held by the caller
+ *
+ * Blocks go straight to their slab or the free list, not into the
+ * draining thread's cache, since that may not be the thread that queued them.
+ * They are pushed without coalescing; unless the maintenance thread will
+ * tidy up, one consolidate_locked pass then merges the whole batch.
+ *
+ * @param queue The queue to drain
+ */
+static void drain_locked(defer_queue *queue) {
+    void *block = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&queue->count, 0, __ATOMIC_RELAXED);
+    if (!block) {
+        return;
+    }
+
+    int defer = MAIN_HEAP.defer;
+    MAIN_HEAP.defer = 1;
+    while (block) {
+        void *next = *(void **)block;
+        TU_PREFETCH_ADDR(next);
+        release_locked(block);
+        block = next;
+    }
+    MAIN_HEAP.defer = defer;
+    if (!defer) {
+        consolidate_locked(&MAIN_HEAP);
+    }
+}
+
+/**
+ * Drain every thread's queue; main heap lock held by the caller
+ */
+void defer_drain_all_locked(void) {
+    for (defer_queue *queue = __atomic_load_n(&QUEUES, __ATOMIC_ACQUIRE); queue; queue = queue->next) {
+        if (__atomic_load_n(&queue->head, __ATOMIC_RELAXED)) {
+            drain_locked(queue);
+        }
+    }
+}
+
+/**
+ * Removes a chunk of memory later, keeping the caller off the heap lock
+ *
+ * A small block still goes to the thread cache if its bin has room, since
+ * that never takes a lock. Anything that would reach the heap lock goes on
+ * the calling thread's queue instead, with one uncontended
+ * compare-and-swap. The maintenance thread (see tumalloc_background) frees
+ * every queue in bulk on each tick; without it, a thread frees its own
+ * queue once DEFER_BATCH blocks have piled up, or on tufree_deferred_flush.
+ * Either way the thread drains its queue itself past DEFER_MAX blocks, and
+ * when it exits.
+ *
+ * @param ptr Pointer to the allocated piece of memory, NULL is ignored
+ */
+void tufree_deferred(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    tu_tcache *tcache = &tu_tcache_tls;
+    size_t size = ((free_block *)ptr - 1)->size;
+    if (size <= TU_SMALL_MAX) {
+        // A bin with room never takes the lock, so it beats the queue
+        tu_tcache_bin *bin = &tcache->bins[tu_block_class(size)];
+        if (bin->count < TU_TCACHE_CAP) {
+            tcache_register();
+            *(void **)ptr = bin->head;
+            bin->head = ptr;
+            bin->count++;
+            return;
+        }
+    }
+
+    defer_queue *queue = tcache->defer_queue ? tcache->defer_queue : queue_acquire(tcache);
+    if (!queue) {
+        tufree(ptr);
+        return;
+    }
+
+    void *head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&queue->head, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    size_t count = __atomic_add_fetch(&queue->count, 1, __ATOMIC_RELAXED);
+    size_t limit = __atomic_load_n(&MAIN_HEAP.defer, __ATOMIC_RELAXED) ? DEFER_MAX : DEFER_BATCH;
+    if (count >= limit) {
+        pthread_mutex_lock(&MAIN_HEAP.lock);
+        drain_locked(queue);
+        pthread_mutex_unlock(&MAIN_HEAP.lock);
+    }
+}
+
+/**
+ * Frees everything the calling thread has queued with tufree_deferred
+ *
+ * For a latency-critical thread to call when it is idle.
+ */
+void tufree_deferred_flush(void) {
+    defer_queue *queue = tu_tcache_tls.defer_queue;
+    if (!queue || !__atomic_load_n(&queue->head, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    drain_locked(queue);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+}
+
+/**
+ * Thread exit: free whatever the thread still has queued and give up the queue
+ *
+ * @param tcache The exiting thread's cache
+ */
+void defer_thread_exit(tu_tcache *tcache) {
+    defer_queue *queue = tcache->defer_queue;
+    if (!queue) {
+        return;
+    }
+
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    drain_locked(queue);
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    tcache->defer_queue = NULL;
+    __atomic_store_n(&queue->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Fork handler: the child frees what every thread had queued and lets go of
+ * the queues of threads it does not have
+ */
+static void postfork_child(void) {
+    pthread_mutex_lock(&MAIN_HEAP.lock);
+    defer_drain_all_locked();
+    pthread_mutex_unlock(&MAIN_HEAP.lock);
+    for (defer_queue *queue = QUEUES; queue; queue = queue->next) {
+        if (queue != tu_tcache_tls.defer_queue) {
+            queue->in_use = 0;
+        }
+    }
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void) {
+    pthread_atfork(NULL, NULL, postfork_child);
+}
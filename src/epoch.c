@@ -0,0 +1,290 @@
+#include "internal.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RETIRE_BATCH 64 /**< Retired blocks between attempts to advance the epoch */
+#define RETIRE_MIN 64 /**< First size of a retire array */
+
+/**
+ * A thread's announcement of the epoch it is reading in
+ *
+ * Records are never freed; a thread that exits leaves its record for the
+ * next new thread to pick up.
+ */
+typedef struct tu_epoch_record {
+    struct tu_epoch_record *next; /**< Next record in the registry */
+    unsigned long state; /**< Epoch shifted left once, low bit set while the owner is inside; atomic */
+    int in_use; /**< Whether a thread owns the record; atomic */
+} epoch_record;
+
+/**
+ * The global epoch, every thread's record and blocks left by exited threads
+ */
+static struct {
+    pthread_mutex_t lock; /**< Guards the orphans */
+    unsigned long global; /**< The global epoch; atomic */
+    epoch_record *records; /**< Every record ever made, only ever pushed to; atomic */
+    void **orphans; /**< Retired blocks whose threads exited before they could be freed */
+    size_t orphan_count; /**< Blocks in orphans */
+    size_t orphan_cap; /**< Room in orphans */
+    unsigned long orphan_epoch; /**< Newest epoch any orphan was retired in */
+} EPOCH = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, 0, 0, 0 };
+
+/**
+ * Give the calling thread a record, reusing one an exited thread left behind
+ *
+ * @param tcache The calling thread's cache
+ * @return The record, or NULL
+ */
+static epoch_record *record_acquire(tu_tcache *tcache) {
+    epoch_record *rec = __atomic_load_n(&EPOCH.records, __ATOMIC_ACQUIRE);
+    for (; rec; rec = rec->next) {
+        int unused = 0;
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&rec->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (!rec) {
+        rec = tumalloc(sizeof(epoch_record));
+        if (!rec) {
+            return NULL;
+        }
+        rec->state = 0;
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&EPOCH.records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&EPOCH.records, &rec->next, rec, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    tcache->epoch = rec;
+    tcache_register();
+    return rec;
+}
+
+/**
+ * Move the global epoch on if every thread inside has caught up with it
+ */
+static void try_advance(void) {
+    unsigned long global = __atomic_load_n(&EPOCH.global, __ATOMIC_SEQ_CST);
+    for (epoch_record *rec = __atomic_load_n(&EPOCH.records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && state >> 1 != global) {
+            return;
+        }
+    }
+    __atomic_compare_exchange_n(&EPOCH.global, &global, global + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/**
+ * Whether no thread can still be reading blocks retired in an epoch
+ *
+ * A block retired in epoch e may be seen by threads that entered in e - 1
+ * or e. The global epoch only reaches e + 2 once all of them have left.
+ */
+static inline int is_safe(unsigned long epoch, unsigned long global) {
+    return global - epoch >= 2;
+}
+
+static void free_list(tu_retire_list *list) {
+    for (unsigned int i = 0; i < list->count; i++) {
+        tufree(list->blocks[i]);
+    }
+    list->count = 0;
+}
+
+/**
+ * Free whatever the calling thread and exited threads retired long enough ago
+ *
+ * @param tcache The calling thread's cache
+ */
+static void collect(tu_tcache *tcache) {
+    unsigned long global = __atomic_load_n(&EPOCH.global, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < TU_EPOCH_LISTS; i++) {
+        tu_retire_list *list = &tcache->retire[i];
+        if (list->count && is_safe(list->epoch, global)) {
+            free_list(list);
+        }
+    }
+
+    if (!__atomic_load_n(&EPOCH.orphan_count, __ATOMIC_RELAXED) || pthread_mutex_trylock(&EPOCH.lock)) {
+        return;
+    }
+    if (EPOCH.orphan_count && is_safe(EPOCH.orphan_epoch, global)) {
+        for (size_t i = 0; i < EPOCH.orphan_count; i++) {
+            tufree(EPOCH.orphans[i]);
+        }
+        __atomic_store_n(&EPOCH.orphan_count, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&EPOCH.lock);
+}
+
+/**
+ * Enters a read-side critical section
+ *
+ * Blocks reached inside the section stay allocated until the matching
+ * tu_epoch_exit, even if another thread retires them meanwhile. Sections
+ * nest; only the outermost pair counts.
+ *
+ * @return 0, or -1 if the thread could not be registered
+ */
+int tu_epoch_enter(void) {
+    tu_tcache *tcache = &tu_tcache_tls;
+    if (tcache->epoch_depth++) {
+        return 0;
+    }
+
+    epoch_record *rec = tcache->epoch ? tcache->epoch : record_acquire(tcache);
+    if (!rec) {
+        tcache->epoch_depth--;
+        return -1;
+    }
+
+    // A stale epoch here only holds the global epoch back, it never lets it pass us
+    unsigned long global = __atomic_load_n(&EPOCH.global, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->state, global << 1 | 1, __ATOMIC_SEQ_CST);
+    // The announcement must be visible before the caller reads any shared
+    // pointer; a seq_cst store alone does not order later plain loads on
+    // weakly ordered CPUs
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/**
+ * Leaves a read-side critical section
+ */
+void tu_epoch_exit(void) {
+    tu_tcache *tcache = &tu_tcache_tls;
+    if (!tcache->epoch_depth || --tcache->epoch_depth) {
+        return;
+    }
+    __atomic_store_n(&tcache->epoch->state, tcache->epoch->state & ~1ul, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frees a block once no critical section can still be reading it
+ *
+ * Call it after the block has been unlinked from the shared structure. The
+ * block goes on a per-thread list for the current epoch; every
+ * RETIRE_BATCH retirements the thread tries to move the epoch on and frees
+ * the lists that have become safe.
+ *
+ * @param ptr Pointer to the allocated piece of memory, NULL is ignored
+ * @return 0, or -1 if the list could not grow and the block was left allocated
+ */
+int tu_retire(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+
+    tu_tcache *tcache = &tu_tcache_tls;
+    // Order the caller's unlink before reading the epoch the block is retired in
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long global = __atomic_load_n(&EPOCH.global, __ATOMIC_RELAXED);
+
+    tu_retire_list *list = &tcache->retire[global % TU_EPOCH_LISTS];
+    if (list->epoch != global) {
+        // Whatever is left on this list is at least TU_EPOCH_LISTS epochs old
+        free_list(list);
+        list->epoch = global;
+    }
+    if (list->count == list->cap) {
+        unsigned int cap = list->cap ? list->cap * 2 : RETIRE_MIN;
+        pressure_hold();        // a handler's tu_retire would grow this same list
+        void **blocks = turealloc(list->blocks, cap * sizeof(void *));
+        pressure_release();
+        if (!blocks) {
+            return -1;
+        }
+        list->blocks = blocks;
+        list->cap = cap;
+        tcache_register();
+    }
+    list->blocks[list->count++] = ptr;
+
+    if (list->count % RETIRE_BATCH == 0) {
+        try_advance();
+        collect(tcache);
+    }
+    return 0;
+}
+
+/**
+ * Thread exit: free what is safe, hand the rest to the orphans and give up the record
+ *
+ * @param tcache The exiting thread's cache
+ */
+void epoch_thread_exit(tu_tcache *tcache) {
+    if (tcache->epoch) {
+        __atomic_store_n(&tcache->epoch->state, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&tcache->epoch->in_use, 0, __ATOMIC_RELEASE);
+        tcache->epoch = NULL;
+        tcache->epoch_depth = 0;
+    }
+
+    try_advance();
+    unsigned long global = __atomic_load_n(&EPOCH.global, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < TU_EPOCH_LISTS; i++) {
+        tu_retire_list *list = &tcache->retire[i];
+        if (list->count && !is_safe(list->epoch, global)) {
+            pthread_mutex_lock(&EPOCH.lock);
+            size_t need = EPOCH.orphan_count + list->count;
+            if (need > EPOCH.orphan_cap) {
+                size_t cap = need > EPOCH.orphan_cap * 2 ? need : EPOCH.orphan_cap * 2;
+                pressure_hold();
+                void **orphans = turealloc(EPOCH.orphans, cap * sizeof(void *));
+                pressure_release();
+                if (!orphans) {
+                    // Leak them rather than free blocks someone may be reading
+                    pthread_mutex_unlock(&EPOCH.lock);
+                    list->count = 0;
+                    continue;
+                }
+                EPOCH.orphans = orphans;
+                EPOCH.orphan_cap = cap;
+            }
+            for (unsigned int j = 0; j < list->count; j++) {
+                EPOCH.orphans[EPOCH.orphan_count + j] = list->blocks[j];
+            }
+            __atomic_store_n(&EPOCH.orphan_count, need, __ATOMIC_RELAXED);
+            if (EPOCH.orphan_count == list->count || list->epoch > EPOCH.orphan_epoch) {
+                EPOCH.orphan_epoch = list->epoch;
+            }
+            pthread_mutex_unlock(&EPOCH.lock);
+            list->count = 0;
+        }
+        free_list(list);
+        tufree(list->blocks);
+        list->blocks = NULL;
+        list->cap = 0;
+    }
+}
+
+/**
+ * Fork handlers: the child only has the forking thread, so every other
+ * record is let go or the epoch could never move again
+ */
+static void prefork(void) {
+    pthread_mutex_lock(&EPOCH.lock);
+}
+
+static void postfork_parent(void) {
+    pthread_mutex_unlock(&EPOCH.lock);
+}
+
+static void postfork_child(void) {
+    for (epoch_record *rec = EPOCH.records; rec; rec = rec->next) {
+        if (rec != tu_tcache_tls.epoch) {
+            rec->state = 0;
+            rec->in_use = 0;
+        }
+    }
+    pthread_mutex_unlock(&EPOCH.lock);
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void) {
+    pthread_atfork(prefork, postfork_parent, postfork_child);
+}
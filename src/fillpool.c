@@ -0,0 +1,217 @@
+#include "alloc.h"
+#include "memkern.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILL_MAX_WORKERS 64 /**< Most worker threads the pool will run */
+#define FILL_DEFAULT_THRESHOLD ((size_t)64 * 1024 * 1024) /**< Smallest block split across the pool by default */
+#define FILL_SLICE_ALIGN ((size_t)2 * 1024 * 1024) /**< Slices are cut on these address boundaries, so huge pages are not shared */
+#define FILL_SLICES_PER_THREAD 4 /**< Slices per participating thread, so a slow thread does not hold everyone up */
+
+/**
+ * One zero or copy split into slices; lives on the caller's stack
+ */
+typedef struct fill_job {
+    char *dst; /**< Destination block */
+    const char *src; /**< Source block, NULL to zero */
+    size_t n; /**< Bytes in the block */
+    size_t slice; /**< Bytes between cuts, a multiple of FILL_SLICE_ALIGN */
+    size_t lead; /**< Offset of the first cut, where slice 1 starts */
+    size_t nslices; /**< Slices in the job */
+    size_t next; /**< Next slice to claim, atomic */
+    size_t done; /**< Slices finished, atomic */
+    unsigned int active; /**< Workers that may still touch the job, guarded by the pool lock */
+} fill_job;
+
+/**
+ * Worker pool shared by every huge zero and copy; one job at a time
+ */
+static struct {
+    pthread_mutex_t lock; /**< Guards everything below */
+    pthread_cond_t work; /**< Signalled when a job is posted */
+    pthread_cond_t idle; /**< Signalled when a worker leaves a job */
+    unsigned int workers; /**< Workers wanted, 0 when the mode is off */
+    unsigned int started; /**< Workers running */
+    size_t threshold; /**< Smallest block handed to the pool */
+    fill_job *job; /**< The job being worked on, or NULL */
+    unsigned long generation; /**< Bumped for every job so workers pick each up once */
+} POOL = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, 0 };
+
+/**
+ * Claim and run slices until the job has none left
+ *
+ * @param job The job to help with
+ */
+static void run_slices(fill_job *job) {
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->nslices) {
+            return;
+        }
+        size_t off = i ? job->lead + (i - 1) * job->slice : 0;
+        size_t end = i + 1 < job->nslices ? job->lead + i * job->slice : job->n;
+        size_t len = end - off;
+        if (job->src) {
+            tu_memcopy_stream(job->dst + off, job->src + off, len);
+        }
+        else {
+            tu_memzero_stream(job->dst + off, len);
+        }
+        __atomic_fetch_add(&job->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Worker thread: wait for a job, help with it, repeat
+ */
+static void *worker_main(void *arg) {
+    (void)arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&POOL.lock);
+    for (;;) {
+        while (!POOL.job || POOL.generation == seen) {
+            pthread_cond_wait(&POOL.work, &POOL.lock);
+        }
+        fill_job *job = POOL.job;
+        seen = POOL.generation;
+        job->active++;
+        pthread_mutex_unlock(&POOL.lock);
+
+        run_slices(job);
+
+        pthread_mutex_lock(&POOL.lock);
+        job->active--;
+        pthread_cond_signal(&POOL.idle);
+    }
+    return NULL;
+}
+
+/**
+ * Start workers up to the wanted count; pool lock held by the caller
+ */
+static void start_workers(void) {
+    while (POOL.started < POOL.workers) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, worker_main, NULL);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            break;
+        }
+        POOL.started++;
+    }
+}
+
+/**
+ * Turn parallel zeroing and copying of huge blocks on or off
+ *
+ * With workers > 0, tucalloc and turealloc split blocks of at least threshold
+ * bytes into slices that the calling thread and the workers fill together.
+ * Slices are written by whichever thread claims them, so fresh pages are
+ * first touched (and, under the default NUMA policy, placed) across the
+ * nodes those threads run on. Workers are started on first use and never
+ * stopped; lowering the count only stops using the extra ones.
+ *
+ * @param workers Worker threads besides the caller, 0 to turn the mode off
+ * @param threshold Smallest block to split, 0 for the default of 64 MiB
+ * @return 0 on success, -1 if workers is out of range
+ */
+int tumalloc_parallel_fill(unsigned int workers, size_t threshold) {
+    if (workers > FILL_MAX_WORKERS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&POOL.lock);
+    __atomic_store_n(&POOL.workers, workers, __ATOMIC_RELAXED);
+    POOL.threshold = threshold ? threshold : FILL_DEFAULT_THRESHOLD;
+    pthread_mutex_unlock(&POOL.lock);
+    return 0;
+}
+
+/**
+ * Zero or copy a huge block with the worker pool
+ *
+ * @param dst Destination block
+ * @param src Source block, or NULL to zero dst
+ * @param n Bytes to write
+ * @return 1 if the block was written, 0 if the caller should do it alone
+ */
+int tu_fill_parallel(void *dst, const void *src, size_t n) {
+    if (!__atomic_load_n(&POOL.workers, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    // A job already running keeps the workers busy; don't queue behind it
+    if (pthread_mutex_trylock(&POOL.lock)) {
+        return 0;
+    }
+    if (n < POOL.threshold || POOL.job || !POOL.workers) {
+        pthread_mutex_unlock(&POOL.lock);
+        return 0;
+    }
+    start_workers();
+    unsigned int threads = (POOL.started < POOL.workers ? POOL.started : POOL.workers) + 1;
+    if (threads == 1) {
+        pthread_mutex_unlock(&POOL.lock);
+        return 0;
+    }
+
+    fill_job job = { dst, src, n, 0, 0, 0, 0, 0, 0 };
+    size_t slice = n / (threads * FILL_SLICES_PER_THREAD);
+    job.slice = (slice + FILL_SLICE_ALIGN - 1) & ~(FILL_SLICE_ALIGN - 1);
+
+    // Cut at multiples of the slice from the FILL_SLICE_ALIGN boundary below
+    // dst; a head or tail shorter than FILL_SLICE_ALIGN joins its neighbour
+    size_t before = (uintptr_t)dst & (FILL_SLICE_ALIGN - 1);
+    size_t first = job.slice - before < FILL_SLICE_ALIGN ? 2 : 1;
+    size_t last = before + n >= FILL_SLICE_ALIGN ? (before + n - FILL_SLICE_ALIGN) / job.slice : 0;
+    job.lead = first * job.slice - before;
+    job.nslices = last >= first ? last - first + 2 : 1;
+    POOL.job = &job;
+    POOL.generation++;
+    pthread_cond_broadcast(&POOL.work);
+    pthread_mutex_unlock(&POOL.lock);
+
+    run_slices(&job);
+
+    pthread_mutex_lock(&POOL.lock);
+    while (__atomic_load_n(&job.done, __ATOMIC_ACQUIRE) < job.nslices || job.active) {
+        pthread_cond_wait(&POOL.idle, &POOL.lock);
+    }
+    POOL.job = NULL;
+    pthread_mutex_unlock(&POOL.lock);
+    return 1;
+}
+
+/**
+ * Fork handlers: hold the pool lock across fork so the child gets it
+ * unlocked, with no workers and no job
+ *
+ * The workers and any job in flight belong to threads the child does not
+ * have; its first huge fill starts new workers. The condition variables
+ * may still count the parent's waiters, so they start over too.
+ */
+static void prefork(void) {
+    pthread_mutex_lock(&POOL.lock);
+}
+
+static void postfork_parent(void) {
+    pthread_mutex_unlock(&POOL.lock);
+}
+
+static void postfork_child(void) {
+    POOL.started = 0;
+    POOL.job = NULL;
+    pthread_cond_init(&POOL.work, NULL);
+    pthread_cond_init(&POOL.idle, NULL);
+    pthread_mutex_unlock(&POOL.lock);
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void) {
+    pthread_atfork(prefork, postfork_parent, postfork_child);
+}
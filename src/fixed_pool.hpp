@@ -0,0 +1,171 @@
+#ifndef CYB3053_PROJECT2_FIXED_POOL_HPP
+#define CYB3053_PROJECT2_FIXED_POOL_HPP
+
+#include "alloc.h"
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace tu {
+
+/**
+ * Pool for one type known at compile time
+ *
+ * Slot size, alignment and slab geometry are all constexpr, so allocate and
+ * deallocate come down to a free-list pop/push or a pointer bump with no
+ * size-class lookup. Slabs of N slots come from the tumalloc heap, so the
+ * memory still shows up there. Not thread-safe: use one pool per thread or
+ * guard it externally.
+ *
+ * @tparam T The object type
+ * @tparam N How many slots each slab holds
+ */
+template <class T, std::size_t N = 64>
+class fixed_pool {
+    static_assert(N > 0, "a slab needs at least one slot");
+
+    /**
+     * A free slot, linked through its own storage
+     */
+    struct free_slot {
+        free_slot *next;
+    };
+
+    /**
+     * Link at the start of every slab
+     */
+    struct slab {
+        slab *next;
+    };
+
+    static constexpr std::size_t round_up(std::size_t n, std::size_t align) {
+        return (n + align - 1) / align * align;
+    }
+
+    static constexpr std::size_t max(std::size_t a, std::size_t b) {
+        return a > b ? a : b;
+    }
+
+public:
+    /** Alignment of every slot */
+    static constexpr std::size_t slot_alignment = max(alignof(T), alignof(free_slot));
+    /** Distance between two slots */
+    static constexpr std::size_t slot_size = round_up(max(sizeof(T), sizeof(free_slot)), slot_alignment);
+    /** Slots per slab */
+    static constexpr std::size_t slots_per_slab = N;
+    /** Bytes before the first slot of a slab */
+    static constexpr std::size_t slab_header_size = round_up(sizeof(slab), slot_alignment);
+    /** Size of one slab request, rounded to the heap's 16-byte granularity */
+    static constexpr std::size_t slab_size = round_up(slab_header_size + N * slot_size, 16);
+    /** Alignment a slab request needs from the heap */
+    static constexpr std::size_t slab_alignment = max(slot_alignment, 16);
+
+    fixed_pool() noexcept = default;
+
+    fixed_pool(const fixed_pool &) = delete;
+    fixed_pool &operator=(const fixed_pool &) = delete;
+
+    ~fixed_pool() {
+        release();
+    }
+
+    /**
+     * Get storage for one T
+     *
+     * @return The slot, or nullptr if a new slab could not be allocated
+     */
+    void *allocate() noexcept {
+        if (free_) {
+            free_slot *slot = free_;
+            free_ = slot->next;
+            return slot;
+        }
+        if (bump_ != bump_end_) {
+            char *slot = bump_;
+            bump_ += slot_size;
+            return slot;
+        }
+        return refill();
+    }
+
+    /**
+     * Give storage for one T back to the pool
+     *
+     * @param ptr A slot returned by allocate on this pool
+     */
+    void deallocate(void *ptr) noexcept {
+        free_slot *slot = static_cast<free_slot *>(ptr);
+        slot->next = free_;
+        free_ = slot;
+    }
+
+    /**
+     * Allocate and construct a T
+     */
+    template <class... Args>
+    T *create(Args &&...args) {
+        void *ptr = allocate();
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        try {
+            return ::new (ptr) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(ptr);
+            throw;
+        }
+    }
+
+    /**
+     * Destroy a T made by create and recycle its slot
+     */
+    void destroy(T *obj) noexcept {
+        if (obj) {
+            obj->~T();
+            deallocate(obj);
+        }
+    }
+
+    /**
+     * Return every slab to the heap; all objects from the pool must be dead
+     */
+    void release() noexcept {
+        while (slabs_) {
+            slab *next = slabs_->next;
+            tufree_sized(slabs_, slab_size);
+            slabs_ = next;
+        }
+        free_ = nullptr;
+        bump_ = bump_end_ = nullptr;
+    }
+
+private:
+    /**
+     * Slow path: take a new slab from the heap and hand out its first slot
+     */
+    [[gnu::noinline]] void *refill() noexcept {
+        void *mem = slab_alignment > 16 ? tumemalign(slab_alignment, slab_size) : tumalloc(slab_size);
+        if (!mem) {
+            return nullptr;
+        }
+
+        slab *s = static_cast<slab *>(mem);
+        s->next = slabs_;
+        slabs_ = s;
+
+        char *first = static_cast<char *>(mem) + slab_header_size;
+        bump_ = first + slot_size;
+        bump_end_ = first + N * slot_size;
+        return first;
+    }
+
+    free_slot *free_ = nullptr; /**< Recycled slots, most recent first */
+    char *bump_ = nullptr; /**< Next never-used slot in the newest slab */
+    char *bump_end_ = nullptr; /**< End of the newest slab's slots */
+    slab *slabs_ = nullptr; /**< Every slab the pool owns */
+};
+
+} // namespace tu
+
+#endif //CYB3053_PROJECT2_FIXED_POOL_HPP
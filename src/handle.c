@@ -0,0 +1,411 @@
+#include "internal.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGMENT_MIN (256 * 1024) /**< Smallest segment of movable space */
+#define TABLE_MIN 64 /**< First size of the handle table */
+#define BUDGET_CHECK 32 /**< Blocks scanned between clock reads while compacting */
+
+/**
+ * Header in front of every block in movable space
+ */
+typedef struct move_block {
+    size_t size; /**< Bytes after the header, a multiple of ALIGNMENT */
+    size_t handle; /**< Owning handle, 0 for a dead block or a gap */
+} move_block;
+
+/**
+ * A segment of movable space, borrowed from the main heap
+ *
+ * Blocks are bump allocated and packed back to back from the start of the
+ * data; only compaction reclaims the space of freed blocks.
+ */
+typedef struct move_segment {
+    struct move_segment *next; /**< Next segment, in allocation order */
+    size_t cap; /**< Bytes of data the segment holds */
+    size_t used; /**< Bytes of data in use, blocks and gaps */
+    size_t pad; /**< Keeps the data aligned */
+} move_segment;
+
+/**
+ * Where a handle's block currently lives
+ */
+typedef struct handle_entry {
+    void *ptr; /**< The block's memory, NULL when the entry is free */
+    size_t size; /**< Requested size, or the next free entry's index when free */
+    unsigned int pins; /**< Outstanding tuhandle_lock calls */
+} handle_entry;
+
+/**
+ * Movable space, its handle table and an incremental compaction pass
+ */
+static struct {
+    pthread_mutex_t lock; /**< Guards everything below */
+    handle_entry *table; /**< Entries indexed by handle - 1 */
+    size_t table_size; /**< Entries in the table */
+    size_t table_used; /**< Entries ever handed out */
+    size_t free_entry; /**< First free entry + 1, 0 if none */
+    move_segment *head; /**< First segment */
+    move_segment *tail; /**< Last segment, where new blocks go */
+
+    // Compaction cursors: live blocks move from src down to dst
+    int compacting; /**< Whether a pass is in progress */
+    move_segment *dst_seg; /**< Segment being packed */
+    size_t dst_off; /**< Where the next moved block goes in dst_seg */
+    move_segment *src_seg; /**< Segment being scanned */
+    size_t src_off; /**< Next block to look at in src_seg */
+} SPACE = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, NULL, NULL, 0, NULL, 0, NULL, 0 };
+
+static inline move_block *block_at(move_segment *seg, size_t off) {
+    return (move_block *)((char *)(seg + 1) + off);
+}
+
+/**
+ * Look up a live handle; lock held by the caller
+ *
+ * @return The entry, or NULL for 0, out of range or freed handles
+ */
+static handle_entry *entry_of(tuhandle handle) {
+    if (handle == 0 || handle > SPACE.table_used) {
+        return NULL;
+    }
+    handle_entry *entry = &SPACE.table[handle - 1];
+    return entry->ptr ? entry : NULL;
+}
+
+/**
+ * Take a free table entry, growing the table when needed; lock held by the caller
+ *
+ * @return The entry's handle, or 0
+ */
+static tuhandle new_handle(void) {
+    if (SPACE.free_entry) {
+        tuhandle handle = SPACE.free_entry;
+        SPACE.free_entry = SPACE.table[handle - 1].size;
+        return handle;
+    }
+
+    if (SPACE.table_used == SPACE.table_size) {
+        size_t size = SPACE.table_size ? SPACE.table_size * 2 : TABLE_MIN;
+        pressure_hold();
+        handle_entry *table = turealloc(SPACE.table, size * sizeof(handle_entry));
+        pressure_release();
+        if (!table) {
+            return 0;
+        }
+        SPACE.table = table;
+        SPACE.table_size = size;
+    }
+    return ++SPACE.table_used;
+}
+
+/**
+ * Carve a block from the end of movable space; lock held by the caller
+ *
+ * @param size Bytes after the header, already aligned
+ * @return The block, or NULL
+ */
+static move_block *bump(size_t size) {
+    size_t total = sizeof(move_block) + size;
+    move_segment *seg = SPACE.tail;
+    if (!seg || seg->cap - seg->used < total) {
+        size_t cap = total > SEGMENT_MIN ? total : SEGMENT_MIN;
+        pressure_hold();
+        seg = tumalloc(sizeof(move_segment) + cap);
+        pressure_release();
+        if (!seg) {
+            return NULL;
+        }
+        seg->next = NULL;
+        seg->cap = cap;
+        seg->used = 0;
+        if (SPACE.tail) {
+            SPACE.tail->next = seg;
+        }
+        else {
+            SPACE.head = seg;
+        }
+        SPACE.tail = seg;
+    }
+
+    move_block *block = block_at(seg, seg->used);
+    block->size = size;
+    seg->used += total;
+    return block;
+}
+
+/**
+ * Allocates a relocatable block
+ *
+ * The block lives in movable space, which tuheap_compact may rearrange, so
+ * its address is only stable between tuhandle_lock and tuhandle_unlock.
+ *
+ * @param size The amount of memory to allocate
+ * @return The block's handle, or 0
+ */
+tuhandle tuhandle_alloc(size_t size) {
+    if (size > (size_t)PTRDIFF_MAX / 2) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&SPACE.lock);
+    tuhandle handle = new_handle();
+    if (!handle) {
+        pthread_mutex_unlock(&SPACE.lock);
+        return 0;
+    }
+    move_block *block = bump(ALIGN_UP(size ? size : 1));
+    if (!block) {
+        SPACE.table[handle - 1].ptr = NULL;
+        SPACE.table[handle - 1].size = SPACE.free_entry;
+        SPACE.free_entry = handle;
+        pthread_mutex_unlock(&SPACE.lock);
+        return 0;
+    }
+
+    block->handle = handle;
+    handle_entry *entry = &SPACE.table[handle - 1];
+    entry->ptr = block + 1;
+    entry->size = size;
+    entry->pins = 0;
+    pthread_mutex_unlock(&SPACE.lock);
+    return handle;
+}
+
+/**
+ * Pins a block and returns its current address
+ *
+ * Pins nest; the block cannot move until every lock has been matched by an
+ * unlock.
+ *
+ * @param handle The block's handle
+ * @return The block's memory, or NULL for an invalid handle
+ */
+void *tuhandle_lock(tuhandle handle) {
+    pthread_mutex_lock(&SPACE.lock);
+    handle_entry *entry = entry_of(handle);
+    void *ptr = NULL;
+    if (entry) {
+        entry->pins++;
+        ptr = entry->ptr;
+    }
+    pthread_mutex_unlock(&SPACE.lock);
+    return ptr;
+}
+
+/**
+ * Drops one pin; the pointer from the matching tuhandle_lock may go stale
+ *
+ * @param handle The block's handle
+ */
+void tuhandle_unlock(tuhandle handle) {
+    pthread_mutex_lock(&SPACE.lock);
+    handle_entry *entry = entry_of(handle);
+    if (entry && entry->pins) {
+        entry->pins--;
+    }
+    pthread_mutex_unlock(&SPACE.lock);
+}
+
+/**
+ * Size that was requested for a relocatable block
+ *
+ * @param handle The block's handle
+ * @return The size, 0 for an invalid handle
+ */
+size_t tuhandle_size(tuhandle handle) {
+    pthread_mutex_lock(&SPACE.lock);
+    handle_entry *entry = entry_of(handle);
+    size_t size = entry ? entry->size : 0;
+    pthread_mutex_unlock(&SPACE.lock);
+    return size;
+}
+
+/**
+ * Frees a relocatable block; its space comes back at the next compaction
+ *
+ * @param handle The block's handle, 0 is ignored
+ */
+void tuhandle_free(tuhandle handle) {
+    pthread_mutex_lock(&SPACE.lock);
+    handle_entry *entry = entry_of(handle);
+    if (entry) {
+        ((move_block *)entry->ptr - 1)->handle = 0;
+        entry->ptr = NULL;
+        entry->size = SPACE.free_entry;
+        SPACE.free_entry = handle;
+    }
+    pthread_mutex_unlock(&SPACE.lock);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * End a compaction pass: trim the packed segment and give empty ones back
+ *
+ * Every segment after dst_seg has been emptied by the pass. Handing them to
+ * tufree lets the main heap trim the break if they sit at its top.
+ */
+static void finish_pass(void) {
+    move_segment *seg = SPACE.dst_seg;
+    seg->used = SPACE.dst_off;
+
+    move_segment *rest = seg->next;
+    seg->next = NULL;
+    SPACE.tail = seg;
+    while (rest) {
+        move_segment *next = rest->next;
+        tufree(rest);
+        rest = next;
+    }
+    SPACE.compacting = 0;
+}
+
+/**
+ * Give back the segments a pass has emptied in front of a pinned block
+ *
+ * Every segment from keep's successor up to to has had its blocks moved
+ * down or found dead, and packing is about to jump past them.
+ *
+ * @param keep The last segment to keep, NULL to give back from the head
+ * @param to The segment packing carries on in
+ */
+static void release_until(move_segment *keep, move_segment *to) {
+    move_segment *seg = keep ? keep->next : SPACE.head;
+    if (keep) {
+        keep->next = to;
+    }
+    else {
+        SPACE.head = to;
+    }
+    while (seg != to) {
+        move_segment *next = seg->next;
+        tufree(seg);
+        seg = next;
+    }
+}
+
+/**
+ * Compacts movable space, sliding unpinned blocks down over freed ones
+ *
+ * Live blocks are moved towards the first segment in allocation order, so
+ * the last segments empty out and go back to the main heap (and to the OS
+ * when they sit at the top of the heap). Pinned blocks stay put and the
+ * space in front of them is left as a gap. Work is incremental: a pass that
+ * runs out of budget resumes where it stopped on the next call.
+ *
+ * @param budget_ns Time to spend, 0 to finish the pass
+ * @return 1 when the pass is finished, 0 if work is left
+ */
+int tuheap_compact(unsigned long long budget_ns) {
+    uint64_t deadline = budget_ns ? now_ns() + budget_ns : 0;
+    unsigned int scanned = 0;
+
+    pthread_mutex_lock(&SPACE.lock);
+    if (!SPACE.compacting) {
+        if (!SPACE.head) {
+            pthread_mutex_unlock(&SPACE.lock);
+            return 1;
+        }
+        SPACE.compacting = 1;
+        SPACE.dst_seg = SPACE.src_seg = SPACE.head;
+        SPACE.dst_off = SPACE.src_off = 0;
+    }
+
+    while (SPACE.src_seg) {
+        // Dead and pinned blocks count too: a pass over nothing but those still takes time
+        if (deadline && ++scanned % BUDGET_CHECK == 0 && now_ns() >= deadline) {
+            pthread_mutex_unlock(&SPACE.lock);
+            return 0;
+        }
+        move_segment *src = SPACE.src_seg;
+        if (SPACE.src_off >= src->used) {
+            if (src != SPACE.dst_seg) {
+                src->used = 0;      // every block in it has moved down or died
+            }
+            SPACE.src_seg = src->next;
+            SPACE.src_off = 0;
+            continue;
+        }
+
+        move_block *block = block_at(src, SPACE.src_off);
+        size_t total = sizeof(move_block) + block->size;
+        if (block->handle == 0) {
+            SPACE.src_off += total;
+            continue;
+        }
+
+        handle_entry *entry = &SPACE.table[block->handle - 1];
+        if (entry->pins) {
+            // Can't move it: packing carries on right behind it, and the
+            // segments emptied in between (dst_seg too, if nothing was
+            // packed into it) go back to the main heap
+            if (SPACE.dst_seg != src) {
+                move_segment *keep = SPACE.dst_seg;
+                if (SPACE.dst_off == 0) {
+                    move_segment *prev = NULL;
+                    for (move_segment *seg = SPACE.head; seg != keep; seg = seg->next) {
+                        prev = seg;
+                    }
+                    keep = prev;
+                }
+                else {
+                    keep->used = SPACE.dst_off;
+                }
+                release_until(keep, src);
+                SPACE.dst_seg = src;
+                SPACE.dst_off = 0;
+            }
+            if (SPACE.dst_off < SPACE.src_off) {
+                move_block *gap = block_at(src, SPACE.dst_off);
+                gap->size = SPACE.src_off - SPACE.dst_off - sizeof(move_block);
+                gap->handle = 0;
+            }
+            SPACE.src_off += total;
+            SPACE.dst_off = SPACE.src_off;
+            continue;
+        }
+
+        while (SPACE.dst_seg != src && SPACE.dst_seg->cap - SPACE.dst_off < total) {
+            SPACE.dst_seg->used = SPACE.dst_off;
+            SPACE.dst_seg = SPACE.dst_seg->next;
+            SPACE.dst_off = 0;
+        }
+        if (SPACE.dst_seg != src || SPACE.dst_off != SPACE.src_off) {
+            move_block *to = block_at(SPACE.dst_seg, SPACE.dst_off);
+            memmove(to, block, total);
+            entry->ptr = to + 1;
+        }
+        SPACE.dst_off += total;
+        SPACE.src_off += total;
+    }
+
+    finish_pass();
+    pthread_mutex_unlock(&SPACE.lock);
+    return 1;
+}
+
+/**
+ * Fork handlers: keep the movable-space lock consistent in the child
+ *
+ * Registered after the heap's, so this lock is taken before the heap lock.
+ */
+static void prefork(void) {
+    pthread_mutex_lock(&SPACE.lock);
+}
+
+static void postfork(void) {
+    pthread_mutex_unlock(&SPACE.lock);
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void) {
+    pthread_atfork(prefork, postfork, postfork);
+}
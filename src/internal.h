@@ -0,0 +1,124 @@
+#ifndef CYB3053_PROJECT2_INTERNAL_H
+#define CYB3053_PROJECT2_INTERNAL_H
+
+#include "alloc.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Shared between the allocator's translation units; not part of the API
+ */
+
+#define ALIGNMENT 16 /**< The alignment of the memory blocks */
+#define ALIGN_UP(n) (((n) + ALIGNMENT - 1) & ~((size_t)ALIGNMENT - 1)) /**< Round a size up to ALIGNMENT */
+
+/**
+ * Link at the start of every chunk a heap instance borrows from the main heap
+ */
+typedef struct heap_chunk {
+    struct heap_chunk *next; /**< Next chunk owned by the same heap */
+    size_t pad; /**< Keeps the first block of the chunk aligned */
+} heap_chunk;
+
+/**
+ * A heap: a free list and the memory behind it
+ *
+ * The main heap grows with sbrk. Heap instances borrow chunks from the main
+ * heap and hand them all back when destroyed.
+ */
+struct tuheap {
+    free_block *head; /**< Pointer to the first element of the free list */
+    pthread_mutex_t lock; /**< Guards the free list (and the program break for the main heap) */
+    heap_chunk *chunks; /**< Chunks borrowed from the main heap, always NULL for the main heap */
+    int defer; /**< Whether frees skip coalescing and trimming, left to consolidate_locked */
+};
+
+/**
+ * Prefetch the block after a free-list node's successor, keeping one miss in flight during a walk
+ */
+#ifdef TU_PREFETCH
+#define TU_PREFETCH_AHEAD(block) do { if ((block)->next) __builtin_prefetch((block)->next->next); } while (0)
+#else
+#define TU_PREFETCH_AHEAD(block) ((void)0)
+#endif
+
+extern tuheap MAIN_HEAP; /**< The heap behind tumalloc; its lock also guards the slabs */
+
+void epoch_thread_exit(tu_tcache *tcache);
+void defer_thread_exit(tu_tcache *tcache);
+void defer_drain_all_locked(void);
+
+void *alloc_locked(tuheap *heap, size_t size);
+void free_locked(tuheap *heap, void *ptr);
+void *memalign_locked(tuheap *heap, size_t alignment, size_t size);
+void consolidate_locked(tuheap *heap);
+void purge_locked(void);
+
+extern unsigned long TRIM_GEN; /**< Bumped when thread caches should shrink; atomic */
+
+/**
+ * Knobs that follow the container's memory budget, see tumalloc_cgroup_tune
+ */
+typedef struct tu_tuning {
+    unsigned int purge_ticks; /**< Maintenance ticks between purges */
+    unsigned int trim_ticks; /**< Maintenance ticks between requests for thread caches to shrink */
+    size_t purge_min; /**< Smallest free block whose pages are purged */
+    unsigned int tcache_fill; /**< Most blocks a thread-cache bin is filled to, at most TU_TCACHE_CAP */
+    size_t grow_step; /**< Least the main heap moves the break by, 0 for exactly what is needed */
+} tu_tuning;
+
+extern tu_tuning TUNING; /**< Current knobs; guarded by the main heap lock */
+
+void limits_press_locked(void);
+int heap_owns(const void *ptr);
+int cgroup_tune_dir(const char *dir, size_t mount_len);
+
+/**
+ * Keep pressure handlers off this thread while the allocator allocates for itself
+ *
+ * Wrap allocations made under one of the allocator's own locks, or halfway
+ * through updating its own state: a handler may call straight back in with
+ * tuhandle_free, tu_retire or tuheap_free. Pairs nest.
+ */
+static inline void pressure_hold(void) {
+    tu_tcache_tls.no_pressure++;
+}
+
+static inline void pressure_release(void) {
+    tu_tcache_tls.no_pressure--;
+}
+
+/**
+ * Slabs: small blocks of one class packed into a run of pages
+ *
+ * Every block keeps its free_block header. While a slab block is allocated
+ * (or sitting in a thread cache) its header's next field points at the slab
+ * that owns it; for blocks from the main free list it is NULL. Spans, large
+ * blocks on whole pages of the same page heap, point at their own header.
+ */
+size_t slab_refill(size_t cls, tu_tcache_bin *bin, size_t want);
+void slab_free_block(free_block *block);
+void *slab_alloc_near(size_t cls, void *hint);
+size_t slab_release_empty(void);
+void slab_purge_pages(size_t min);
+void *span_alloc(size_t size);
+int slab_should_move(free_block *block);
+
+/**
+ * Give a block back to its slab or the main free list, bypassing the thread cache
+ *
+ * @param ptr Pointer to the allocated piece of memory, main heap lock held by the caller
+ */
+static inline void release_locked(void *ptr) {
+    free_block *block = (free_block *)ptr - 1;
+    if (block->next) {
+        slab_free_block(block);
+    }
+    else {
+        free_locked(&MAIN_HEAP, ptr);
+    }
+}
+
+#endif //CYB3053_PROJECT2_INTERNAL_H
@@ -45,8 +45,8 @@ void list_add(node *list, int data) {
         curr = curr->next;
     }
 
-    // Add a new element to the end of the list
-    curr->next = (node *)tumalloc(sizeof(node));
+    // Add a new element to the end of the list, next to the current last one
+    curr->next = (node *)tumalloc_near(curr, sizeof(node));
 
     // Check if the allocation was successful
     if (curr->next == NULL) {
@@ -263,8 +263,8 @@ int main(int argc, char** argv) {
         printf("%d\n", bigger_things[i]);
     }
 
-    // Free the allocated memory
-    tufree(more_things);
+    // Free the allocated memory (turealloc already released more_things)
+    tufree(bigger_things);
 
     return 0;
 }
@@ -0,0 +1,226 @@
+#include "memkern.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TU_HAVE_STREAM_KERNELS 1
+#endif
+
+static void zero_plain(void *dst, size_t n) {
+    memset(dst, 0, n);
+}
+
+static void copy_plain(void *dst, const void *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+#ifdef TU_HAVE_STREAM_KERNELS
+
+#define STREAM_PAGE 4096 /**< Copies walk four pages side by side, which keeps more DRAM pages open */
+
+/**
+ * Bytes to write normally before dst reaches the given alignment
+ *
+ * Every kernel checks n against it first: a block shorter than the head
+ * is written normally in one go.
+ */
+static inline size_t head_bytes(const void *dst, size_t align) {
+    return (size_t)(-(uintptr_t)dst) & (align - 1);
+}
+
+__attribute__((target("avx2")))
+static void zero_avx2(void *dst, size_t n) {
+    char *d = dst;
+    size_t head = head_bytes(d, 32);
+    if (n < head) {
+        memset(d, 0, n);
+        return;
+    }
+    memset(d, 0, head);
+    d += head;
+    n -= head;
+
+    const __m256i zero = _mm256_setzero_si256();
+    for (; n >= 128; n -= 128, d += 128) {
+        _mm256_stream_si256((__m256i *)d, zero);
+        _mm256_stream_si256((__m256i *)(d + 32), zero);
+        _mm256_stream_si256((__m256i *)(d + 64), zero);
+        _mm256_stream_si256((__m256i *)(d + 96), zero);
+    }
+    _mm_sfence();
+    memset(d, 0, n);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(void *dst, const void *src, size_t n) {
+    char *d = dst;
+    const char *s = src;
+    size_t head = head_bytes(d, 32);
+    if (n < head) {
+        memcpy(d, s, n);
+        return;
+    }
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    for (; n >= 4 * STREAM_PAGE; n -= 4 * STREAM_PAGE, d += 4 * STREAM_PAGE, s += 4 * STREAM_PAGE) {
+        for (size_t off = 0; off < STREAM_PAGE; off += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(s + off));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(s + STREAM_PAGE + off));
+            __m256i c = _mm256_loadu_si256((const __m256i *)(s + 2 * STREAM_PAGE + off));
+            __m256i e = _mm256_loadu_si256((const __m256i *)(s + 3 * STREAM_PAGE + off));
+            _mm256_stream_si256((__m256i *)(d + off), a);
+            _mm256_stream_si256((__m256i *)(d + STREAM_PAGE + off), b);
+            _mm256_stream_si256((__m256i *)(d + 2 * STREAM_PAGE + off), c);
+            _mm256_stream_si256((__m256i *)(d + 3 * STREAM_PAGE + off), e);
+        }
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+__attribute__((target("avx512f")))
+static void zero_avx512(void *dst, size_t n) {
+    char *d = dst;
+    size_t head = head_bytes(d, 64);
+    if (n < head) {
+        memset(d, 0, n);
+        return;
+    }
+    memset(d, 0, head);
+    d += head;
+    n -= head;
+
+    const __m512i zero = _mm512_setzero_si512();
+    for (; n >= 256; n -= 256, d += 256) {
+        _mm512_stream_si512((__m512i *)d, zero);
+        _mm512_stream_si512((__m512i *)(d + 64), zero);
+        _mm512_stream_si512((__m512i *)(d + 128), zero);
+        _mm512_stream_si512((__m512i *)(d + 192), zero);
+    }
+    _mm_sfence();
+    memset(d, 0, n);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(void *dst, const void *src, size_t n) {
+    char *d = dst;
+    const char *s = src;
+    size_t head = head_bytes(d, 64);
+    if (n < head) {
+        memcpy(d, s, n);
+        return;
+    }
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    for (; n >= 4 * STREAM_PAGE; n -= 4 * STREAM_PAGE, d += 4 * STREAM_PAGE, s += 4 * STREAM_PAGE) {
+        for (size_t off = 0; off < STREAM_PAGE; off += 64) {
+            __m512i a = _mm512_loadu_si512(s + off);
+            __m512i b = _mm512_loadu_si512(s + STREAM_PAGE + off);
+            __m512i c = _mm512_loadu_si512(s + 2 * STREAM_PAGE + off);
+            __m512i e = _mm512_loadu_si512(s + 3 * STREAM_PAGE + off);
+            _mm512_stream_si512((__m512i *)(d + off), a);
+            _mm512_stream_si512((__m512i *)(d + STREAM_PAGE + off), b);
+            _mm512_stream_si512((__m512i *)(d + 2 * STREAM_PAGE + off), c);
+            _mm512_stream_si512((__m512i *)(d + 3 * STREAM_PAGE + off), e);
+        }
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+#endif
+
+/**
+ * Streaming kernels picked for this CPU
+ */
+typedef struct mem_kernels {
+    void (*zero)(void *, size_t);
+    void (*copy)(void *, const void *, size_t);
+} mem_kernels;
+
+static const mem_kernels PLAIN = { zero_plain, copy_plain };
+#ifdef TU_HAVE_STREAM_KERNELS
+static const mem_kernels AVX2 = { zero_avx2, copy_avx2 };
+static const mem_kernels AVX512 = { zero_avx512, copy_avx512 };
+#endif
+
+static const mem_kernels *KERNELS = NULL; /**< Chosen on first use */
+
+/**
+ * Pick the kernels once; racing first calls all pick the same ones
+ */
+static const mem_kernels *kernels(void) {
+    const mem_kernels *k = __atomic_load_n(&KERNELS, __ATOMIC_ACQUIRE);
+    if (k) {
+        return k;
+    }
+
+    k = &PLAIN;
+#ifdef TU_HAVE_STREAM_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        k = &AVX512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        k = &AVX2;
+    }
+#endif
+    __atomic_store_n(&KERNELS, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+/**
+ * Zero a block, bypassing the cache when it is big
+ *
+ * @param dst The memory to clear
+ * @param n How many bytes
+ */
+void tu_memzero(void *dst, size_t n) {
+    if (n < TU_STREAM_THRESHOLD) {
+        memset(dst, 0, n);
+        return;
+    }
+    if (!tu_fill_parallel(dst, NULL, n)) {
+        kernels()->zero(dst, n);
+    }
+}
+
+/**
+ * Copy between two blocks that do not overlap, bypassing the cache when it is big
+ *
+ * @param dst Where to copy to
+ * @param src Where to copy from
+ * @param n How many bytes
+ */
+void tu_memcopy(void *dst, const void *src, size_t n) {
+    if (n < TU_STREAM_THRESHOLD) {
+        memcpy(dst, src, n);
+        return;
+    }
+    if (!tu_fill_parallel(dst, src, n)) {
+        kernels()->copy(dst, src, n);
+    }
+}
+
+/**
+ * Zero with the streaming kernel whatever the size; one slice of a parallel fill
+ */
+void tu_memzero_stream(void *dst, size_t n) {
+    kernels()->zero(dst, n);
+}
+
+/**
+ * Copy with the streaming kernel whatever the size; one slice of a parallel fill
+ */
+void tu_memcopy_stream(void *dst, const void *src, size_t n) {
+    kernels()->copy(dst, src, n);
+}
+
@@ -0,0 +1,26 @@
+#ifndef CYB3053_PROJECT2_MEMKERN_H
+#define CYB3053_PROJECT2_MEMKERN_H
+
+#include <stddef.h>
+
+/**
+ * Bulk zero and copy for big blocks
+ *
+ * Below TU_STREAM_THRESHOLD these are memset/memcpy. Above it they use
+ * non-temporal AVX-512 or AVX2 stores, picked on first use, so filling a
+ * huge block does not evict the caller's working set. Blocks past the
+ * tumalloc_parallel_fill threshold are split across the fill pool.
+ */
+
+#ifndef TU_STREAM_THRESHOLD
+#define TU_STREAM_THRESHOLD (1024 * 1024) /**< Smallest block written with non-temporal stores */
+#endif
+
+void tu_memzero(void *dst, size_t n);
+void tu_memcopy(void *dst, const void *src, size_t n);
+
+void tu_memzero_stream(void *dst, size_t n);
+void tu_memcopy_stream(void *dst, const void *src, size_t n);
+int tu_fill_parallel(void *dst, const void *src, size_t n);
+
+#endif //CYB3053_PROJECT2_MEMKERN_H
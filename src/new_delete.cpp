@@ -0,0 +1,133 @@
+#include "alloc.h"
+
+#include <cstddef>
+#include <new>
+
+/**
+ * Replacement global operator new/delete on top of tumalloc
+ *
+ * Link tumalloc_cxx into a C++ program and every new/delete, including the
+ * sized, aligned and nothrow overloads, is served by the allocator.
+ */
+
+namespace {
+
+/**
+ * Allocate like operator new: retry through the new_handler until it succeeds
+ *
+ * @param size The amount of memory to allocate
+ * @param alignment The required alignment, 0 for the default
+ * @return A pointer to the memory; throws std::bad_alloc when no handler is left
+ */
+void *allocate(std::size_t size, std::size_t alignment) {
+    // Zero-sized requests still need a unique pointer
+    if (size == 0) {
+        size = 1;
+    }
+
+    for (;;) {
+        void *ptr = alignment ? tumemalign(alignment, size) : tumalloc(size);
+        if (ptr) {
+            return ptr;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+/**
+ * Nothrow flavour of allocate: handler exceptions turn into nullptr
+ */
+void *allocate_nothrow(std::size_t size, std::size_t alignment) noexcept {
+    try {
+        return allocate(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    return allocate(size, 0);
+}
+
+void *operator new[](std::size_t size) {
+    return allocate(size, 0);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept {
+    tufree(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    tufree(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept {
+    tufree_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept {
+    tufree_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    tufree(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    tufree(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept {
+    tufree_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t) noexcept {
+    tufree_sized(ptr, size);
+}
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include "internal.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Drop-in libc allocator entry points on top of tumalloc
+ *
+ * Built into libtumalloc_preload.so so unmodified programs can run on the
+ * allocator with LD_PRELOAD. Only these symbols are exported from the library.
+ * Blocks from outside the heap, handed out before the library took over,
+ * are freed, resized and measured by the allocator behind it.
+ */
+#define TU_EXPORT __attribute__((visibility("default")))
+
+/**
+ * Multiply two sizes, reporting overflow
+ *
+ * @param num The element count
+ * @param size The element size
+ * @param out Where to store the product
+ * @return 0 on success, -1 if the product does not fit in a size_t
+ */
+static int mul_size(size_t num, size_t size, size_t *out) {
+    if (size != 0 && num > ((size_t)-1) / size) {
+        return -1;
+    }
+    *out = num * size;
+    return 0;
+}
+
+/**
+ * Set errno on failure, as callers of the libc functions expect
+ */
+static void *check_oom(void *ptr) {
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Look up the next definition of an allocator entry point, the one this
+ * library stands in front of, once
+ *
+ * @param cache Where the lookup is kept
+ * @param name The symbol
+ * @return The function, or NULL if there is none
+ */
+static void *next_symbol(void **cache, const char *name) {
+    void *fn = __atomic_load_n(cache, __ATOMIC_ACQUIRE);
+    if (!fn) {
+        fn = dlsym(RTLD_NEXT, name);
+        __atomic_store_n(cache, fn, __ATOMIC_RELEASE);
+    }
+    return fn;
+}
+
+/**
+ * Free a block from the allocator that ran before this one was in place
+ *
+ * Those blocks go back where they came from; with no allocator behind
+ * this one they are left alone.
+ */
+static void foreign_free(void *ptr) {
+    static void *next_free;
+    void (*release)(void *) = (void (*)(void *))next_symbol(&next_free, "free");
+    if (release) {
+        release(ptr);
+    }
+}
+
+static size_t foreign_usable_size(void *ptr) {
+    static void *next_usable_size;
+    size_t (*usable)(void *) = (size_t (*)(void *))next_symbol(&next_usable_size, "malloc_usable_size");
+    return usable ? usable(ptr) : 0;
+}
+
+TU_EXPORT void *malloc(size_t size) {
+    // malloc(0) must return a unique pointer that can be freed
+    return check_oom(tumalloc(size ? size : 1));
+}
+
+TU_EXPORT void free(void *ptr) {
+    if (ptr && !heap_owns(ptr)) {
+        foreign_free(ptr);
+        return;
+    }
+    tufree(ptr);
+}
+
+TU_EXPORT void cfree(void *ptr) {
+    free(ptr);
+}
+
+TU_EXPORT void *calloc(size_t num, size_t size) {
+    size_t total;
+    if (mul_size(num, size, &total) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return check_oom(total ? tucalloc(num, size) : tucalloc(1, 1));
+}
+
+TU_EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr && size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (ptr && !heap_owns(ptr)) {
+        // Move the block over to this allocator
+        void *moved = tumalloc(size);
+        if (!moved) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        size_t old_size = foreign_usable_size(ptr);
+        memcpy(moved, ptr, old_size < size ? old_size : size);
+        foreign_free(ptr);
+        return moved;
+    }
+    return check_oom(turealloc(ptr, size ? size : 1));
+}
+
+TU_EXPORT void *reallocarray(void *ptr, size_t num, size_t size) {
+    size_t total;
+    if (mul_size(num, size, &total) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+TU_EXPORT int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = tumemalign(alignment, size ? size : 1);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+TU_EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return check_oom(tumemalign(alignment, size ? size : 1));
+}
+
+TU_EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+TU_EXPORT void *valloc(size_t size) {
+    return check_oom(tumemalign((size_t)sysconf(_SC_PAGESIZE), size ? size : 1));
+}
+
+TU_EXPORT void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t rounded = (size + page - 1) & ~(page - 1);
+    if (rounded < size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return check_oom(tumemalign(page, rounded ? rounded : page));
+}
+
+TU_EXPORT size_t malloc_usable_size(void *ptr) {
+    if (ptr && !heap_owns(ptr)) {
+        return foreign_usable_size(ptr);
+    }
+    return tumalloc_usable_size(ptr);
+}
+
+TU_EXPORT int malloc_trim(size_t pad) {
+    (void)pad;
+    return 0;
+}
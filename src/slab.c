@@ -0,0 +1,512 @@
+#include "internal.h"
+#include "bitmap.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CHUNK_PAGES 64 /**< Pages in a slab chunk, and in the first span chunk; bigger chunks mostly grow the break */
+#define CHUNK_MAX_PAGES 1024 /**< Pages in the largest span chunk */
+#define CHUNK_MAP_WORDS (CHUNK_MAX_PAGES / 64) /**< Words in a chunk's free-page bitmap, of which pages / 64 are used */
+#define SPAN_MIN_PAGES 4 /**< Smallest span; rounding smaller blocks up to whole pages wastes too much */
+#define SPAN_MAX_PAGES 64 /**< Largest span; bigger blocks come from the free list, where the top of the heap can be trimmed */
+#define SPAN_CLASS 0xFF /**< Class byte in a span's header */
+#define SPAN_HEADER offsetof(slab, free_map) /**< Bytes before a span's block: the fixed part of a slab header */
+#define NEAR_SCAN 32 /**< Partial slabs looked at when searching the hint's chunk */
+#define COLOR_STEP 64 /**< Slab colors are multiples of a cache line */
+
+/**
+ * A run of pages borrowed from the main heap and cut into slabs and spans
+ */
+typedef struct page_chunk {
+    struct page_chunk *next; /**< Next chunk of the page heap */
+    char *base; /**< First page, TU_PAGE_SIZE aligned */
+    size_t pages; /**< Pages in the chunk, a multiple of 64 */
+    size_t free_pages; /**< Pages not used by a slab or span */
+    int spans; /**< Whether the chunk was added for a span */
+    uint64_t free_map[CHUNK_MAP_WORDS]; /**< One bit per page, set when free */
+} page_chunk;
+
+/**
+ * A slab: blocks of one size class packed behind this header
+ *
+ * Slabs with free blocks sit on their class's partial list; full slabs are
+ * only reachable through their blocks' headers.
+ *
+ * A span (one large block on whole pages) keeps just the fields before
+ * free_map, with cls set to SPAN_CLASS, nslots 1 and nfree 0. Its block
+ * points back at it like a slab block does, so it is freed the same way.
+ */
+typedef struct slab {
+    struct slab *next; /**< Next slab on the partial list */
+    struct slab *prev; /**< Previous slab on the partial list */
+    page_chunk *chunk; /**< Chunk the slab's pages come from */
+    uint8_t cls; /**< Size class of the blocks */
+    uint8_t pages; /**< Pages the slab spans */
+    uint16_t nslots; /**< Blocks in the slab */
+    uint16_t nfree; /**< Blocks not handed out */
+    uint16_t color; /**< Bytes between the header and the first block, a multiple of COLOR_STEP */
+    uint64_t free_map[TU_SLAB_MAP_WORDS]; /**< One bit per block, set when free */
+} slab;
+
+_Static_assert(offsetof(slab, free_map) == 32, "cmake/SizeClasses.cmake assumes a 32-byte fixed slab header");
+_Static_assert(sizeof(slab) <= TU_SLAB_HEADER_SIZE, "slab header outgrew TU_SLAB_HEADER_SIZE");
+_Static_assert(TU_NUM_CLASSES < SPAN_CLASS, "slab header keeps the class in a byte, SPAN_CLASS marks spans");
+_Static_assert(SPAN_MAX_PAGES <= 255, "slab header keeps the page count in a byte");
+_Static_assert(CHUNK_PAGES << 4 == CHUNK_MAX_PAGES, "span chunks double four times");
+
+static const unsigned char SLAB_PAGES[TU_NUM_CLASSES] = TU_CLASS_SLAB_PAGES_TABLE; /**< Pages per slab for each class */
+static const unsigned short SLAB_SLOTS[TU_NUM_CLASSES] = TU_CLASS_SLAB_SLOTS_TABLE; /**< Blocks per slab for each class */
+
+static page_chunk *CHUNKS = NULL; /**< The page heap */
+static size_t SPAN_CHUNKS = 0; /**< Chunks added for spans still in the page heap */
+static page_chunk *LAST_FOUND = NULL; /**< Chunk chunk_of found last; hints come in runs from one chunk */
+static slab *PARTIAL[TU_NUM_CLASSES]; /**< Slabs with free blocks, per class */
+static unsigned int NEXT_COLOR[TU_NUM_CLASSES]; /**< Color the next slab of each class gets */
+static size_t CLASS_SLOTS[TU_NUM_CLASSES]; /**< Blocks in all of a class's slabs */
+static size_t CLASS_FREE[TU_NUM_CLASSES]; /**< Of those, blocks not handed out */
+
+/**
+ * Take a run of free pages from the page heap, adding a chunk if none has room
+ *
+ * Chunks added for slabs have CHUNK_PAGES pages. Chunks added for spans
+ * double with each one already live, up to CHUNK_MAX_PAGES, so a program
+ * that keeps many spans gets few long maps to scan rather than many short
+ * ones.
+ *
+ * @param pages How many pages are needed
+ * @param spans Whether the pages are for a span
+ * @param chunk_out Set to the chunk the pages come from
+ * @return The first page, or NULL
+ */
+static char *pages_alloc(size_t pages, int spans, page_chunk **chunk_out) {
+    for (page_chunk *chunk = CHUNKS; chunk; chunk = chunk->next) {
+        if (chunk->free_pages < pages) {
+            continue;
+        }
+        size_t first = tu_bitmap_find_run(chunk->free_map, chunk->pages / 64, pages);
+        if (first != TU_BITMAP_NONE) {
+            tu_bitmap_clear_range(chunk->free_map, first, pages);
+            chunk->free_pages -= pages;
+            *chunk_out = chunk;
+            return chunk->base + first * TU_PAGE_SIZE;
+        }
+    }
+
+    size_t chunk_pages = CHUNK_PAGES;
+    if (spans) {
+        chunk_pages <<= SPAN_CHUNKS < 4 ? SPAN_CHUNKS : 4;
+    }
+
+    page_chunk *chunk = alloc_locked(&MAIN_HEAP, ALIGN_UP(sizeof(page_chunk)));
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->base = memalign_locked(&MAIN_HEAP, TU_PAGE_SIZE, chunk_pages * TU_PAGE_SIZE);
+    if (!chunk->base) {
+        free_locked(&MAIN_HEAP, chunk);
+        return NULL;
+    }
+    chunk->pages = chunk_pages;
+    chunk->free_pages = chunk_pages - pages;
+    chunk->spans = spans;
+    for (size_t w = 0; w < CHUNK_MAP_WORDS; w++) {
+        chunk->free_map[w] = 0;
+    }
+    tu_bitmap_set_range(chunk->free_map, pages, chunk_pages - pages);
+    chunk->next = CHUNKS;
+    CHUNKS = chunk;
+    SPAN_CHUNKS += (size_t)spans;
+
+    *chunk_out = chunk;
+    return chunk->base;
+}
+
+/**
+ * Give a run of pages back to its chunk; a chunk left empty goes back to the main heap
+ *
+ * @param chunk The chunk the pages came from
+ * @param first The first page
+ * @param pages How many pages
+ */
+static void pages_free(page_chunk *chunk, char *first, size_t pages) {
+    tu_bitmap_set_range(chunk->free_map, (size_t)(first - chunk->base) / TU_PAGE_SIZE, pages);
+    chunk->free_pages += pages;
+    if (chunk->free_pages < chunk->pages) {
+        return;
+    }
+
+    page_chunk **link = &CHUNKS;
+    while (*link != chunk) {
+        link = &(*link)->next;
+    }
+    *link = chunk->next;
+    SPAN_CHUNKS -= (size_t)chunk->spans;
+    if (LAST_FOUND == chunk) {
+        LAST_FOUND = NULL;
+    }
+    free_locked(&MAIN_HEAP, chunk->base);
+    free_locked(&MAIN_HEAP, chunk);
+}
+
+/**
+ * Find the chunk of the page heap an address falls in
+ *
+ * @param ptr Any address
+ * @return The chunk, or NULL if ptr is not in the page heap
+ */
+static page_chunk *chunk_of(const void *ptr) {
+    page_chunk *chunk = LAST_FOUND;
+    if (!chunk || (const char *)ptr < chunk->base || (const char *)ptr >= chunk->base + chunk->pages * TU_PAGE_SIZE) {
+        chunk = CHUNKS;
+        while (chunk && ((const char *)ptr < chunk->base || (const char *)ptr >= chunk->base + chunk->pages * TU_PAGE_SIZE)) {
+            chunk = chunk->next;
+        }
+        LAST_FOUND = chunk ? chunk : LAST_FOUND;
+    }
+    return chunk;
+}
+
+static void partial_push(slab *s) {
+    s->prev = NULL;
+    s->next = PARTIAL[s->cls];
+    if (s->next) {
+        s->next->prev = s;
+    }
+    PARTIAL[s->cls] = s;
+}
+
+static void partial_remove(slab *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    }
+    else {
+        PARTIAL[s->cls] = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+}
+
+/**
+ * Start a new, empty slab for a class and put it on the partial list
+ *
+ * @param cls The size class
+ * @return The slab, or NULL
+ */
+static slab *slab_create(size_t cls) {
+    page_chunk *chunk;
+    slab *s = (slab *)pages_alloc(SLAB_PAGES[cls], 0, &chunk);
+    if (!s) {
+        return NULL;
+    }
+
+    // Rotate the block array through the slab's slack so the first blocks
+    // of different slabs land in different cache sets
+    size_t slack = (size_t)SLAB_PAGES[cls] * TU_PAGE_SIZE - TU_SLAB_HEADER_SIZE
+        - (size_t)SLAB_SLOTS[cls] * (tu_class_size(cls) + sizeof(free_block));
+    size_t colors = slack / COLOR_STEP + 1;
+    s->color = (uint16_t)(NEXT_COLOR[cls]++ % colors * COLOR_STEP);
+
+    s->chunk = chunk;
+    s->cls = (uint8_t)cls;
+    s->nslots = SLAB_SLOTS[cls];
+    s->nfree = SLAB_SLOTS[cls];
+    s->pages = (uint8_t)SLAB_PAGES[cls];
+    for (size_t w = 0; w < TU_SLAB_MAP_WORDS; w++) {
+        s->free_map[w] = 0;
+    }
+    tu_bitmap_set_range(s->free_map, 0, s->nslots);
+    CLASS_SLOTS[cls] += s->nslots;
+    CLASS_FREE[cls] += s->nslots;
+    partial_push(s);
+    return s;
+}
+
+static inline size_t slab_stride(const slab *s) {
+    return tu_class_size(s->cls) + sizeof(free_block);
+}
+
+static inline char *slab_blocks(slab *s) {
+    return (char *)s + TU_SLAB_HEADER_SIZE + s->color;
+}
+
+static inline free_block *slab_block(slab *s, size_t idx) {
+    return (free_block *)(slab_blocks(s) + idx * slab_stride(s));
+}
+
+/**
+ * Fill an empty thread-cache bin from the class's slabs
+ *
+ * Free blocks are found by scanning each slab's bitmap, then taken a whole
+ * word at a time. The bin ends up in address order so consecutive
+ * allocations are adjacent.
+ *
+ * @param cls The size class, main heap lock held by the caller
+ * @param bin The bin to fill
+ * @param want How many blocks to add at most
+ * @return How many blocks were added
+ */
+size_t slab_refill(size_t cls, tu_tcache_bin *bin, size_t want) {
+    size_t class_size = tu_class_size(cls);
+    void **tail = &bin->head;
+    void *rest = bin->head;
+    size_t got = 0;
+
+    while (got < want) {
+        slab *s = PARTIAL[cls];
+        if (!s) {
+            s = slab_create(cls);
+            if (!s) {
+                break;
+            }
+        }
+
+        size_t words = ((size_t)s->nslots + 63) / 64;
+        size_t from = 0;
+        size_t taken = 0;
+        while (got + taken < want) {
+            size_t bit = tu_bitmap_find_set(s->free_map, words, from);
+            if (bit == TU_BITMAP_NONE) {
+                break;
+            }
+            size_t w = bit / 64;
+            uint64_t word = s->free_map[w];
+            while (word && got + taken < want) {
+                free_block *block = slab_block(s, w * 64 + (size_t)__builtin_ctzll(word));
+                word &= word - 1;
+                block->size = class_size;
+                block->next = (free_block *)s;
+                *tail = block + 1;
+                tail = (void **)(block + 1);
+                taken++;
+            }
+            s->free_map[w] = word;
+            from = w + 1;
+        }
+
+        s->nfree -= (uint16_t)taken;
+        CLASS_FREE[cls] -= taken;
+        got += taken;
+        if (s->nfree == 0) {
+            partial_remove(s);
+        }
+    }
+
+    *tail = rest;
+    bin->count += (unsigned int)got;
+    return got;
+}
+
+/**
+ * Take one free block of a class from the hint's slab, or from another slab on the hint's chunk
+ *
+ * In the hint's own slab the first free block after the hint wins, so a
+ * structure built front to back stays in address order.
+ *
+ * @param cls The size class, main heap lock held by the caller
+ * @param hint A live block, or a pointer outside the page heap
+ * @return The block's memory, or NULL if nothing is free close to the hint
+ */
+void *slab_alloc_near(size_t cls, void *hint) {
+    // Only read the hint's header once it is known to sit in the page heap
+    page_chunk *chunk = chunk_of(hint);
+    if (!chunk) {
+        return NULL;
+    }
+
+    // A tuheap block can sit inside a span, on its own free list
+    free_block *hint_block = (free_block *)hint - 1;
+    slab *home = (slab *)hint_block->next;
+    if (!home) {
+        return NULL;
+    }
+
+    slab *s = NULL;
+    size_t from = 0;
+    if (home->cls == cls && home->nfree) {
+        s = home;
+        from = (size_t)((char *)hint_block - slab_blocks(s)) / slab_stride(s) + 1;
+    }
+    else {
+        slab *p = PARTIAL[cls];
+        for (size_t i = 0; p && i < NEAR_SCAN; p = p->next, i++) {
+            if (p->chunk == chunk) {
+                s = p;
+                break;
+            }
+        }
+    }
+    if (!s) {
+        return NULL;
+    }
+
+    size_t words = ((size_t)s->nslots + 63) / 64;
+    size_t bit = TU_BITMAP_NONE;
+    if (from < s->nslots) {
+        uint64_t rest = s->free_map[from / 64] & (~(uint64_t)0 << (from % 64));
+        bit = rest ? (from & ~(size_t)63) + (size_t)__builtin_ctzll(rest) : tu_bitmap_find_set(s->free_map, words, from / 64 + 1);
+    }
+    if (bit == TU_BITMAP_NONE) {
+        bit = tu_bitmap_find_set(s->free_map, words, 0);
+    }
+
+    s->free_map[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+    s->nfree--;
+    CLASS_FREE[cls]--;
+    if (s->nfree == 0) {
+        partial_remove(s);
+    }
+
+    free_block *block = slab_block(s, bit);
+    block->size = tu_class_size(cls);
+    block->next = (free_block *)s;
+    return block + 1;
+}
+
+/**
+ * Return a block to the slab that owns it
+ *
+ * A slab that becomes empty goes back to the page heap unless it is the only
+ * slab its class has left with free blocks. A span goes back whole.
+ *
+ * @param block The block's header, main heap lock held by the caller
+ */
+void slab_free_block(free_block *block) {
+    slab *s = (slab *)block->next;
+    if (s->cls == SPAN_CLASS) {
+        pages_free(s->chunk, (char *)s, s->pages);
+        return;
+    }
+    size_t idx = (size_t)((char *)block - slab_blocks(s)) / slab_stride(s);
+
+    s->free_map[idx / 64] |= (uint64_t)1 << (idx % 64);
+    s->nfree++;
+    CLASS_FREE[s->cls]++;
+    if (s->nfree == 1) {
+        partial_push(s);
+    }
+    else if (s->nfree == s->nslots && (s->prev || s->next)) {
+        partial_remove(s);
+        CLASS_SLOTS[s->cls] -= s->nslots;
+        CLASS_FREE[s->cls] -= s->nslots;
+        pages_free(s->chunk, (char *)s, s->pages);
+    }
+}
+
+/**
+ * Whether moving a block elsewhere would help empty its slab
+ *
+ * A block is worth moving when its slab has a larger share of free blocks
+ * than its class as a whole, so reallocating it lands in a fuller slab.
+ * Full slabs, spans and the slab at the head of the partial list, where
+ * refills draw from, are left alone.
+ *
+ * @param block A live block's header, main heap lock held by the caller
+ * @return 1 to move the block, 0 to leave it
+ */
+int slab_should_move(free_block *block) {
+    slab *s = (slab *)block->next;
+    if (!s || s->cls == SPAN_CLASS || s->nfree == 0 || s == PARTIAL[s->cls]) {
+        return 0;
+    }
+    return (size_t)s->nfree * CLASS_SLOTS[s->cls] > CLASS_FREE[s->cls] * s->nslots;
+}
+
+/**
+ * Give every empty slab but the first of each class back to the page heap
+ *
+ * slab_free_block keeps a slab that empties while it is its class's only
+ * partial slab, and it stays behind empty once other slabs join the list.
+ * The main heap lock is held by the caller.
+ *
+ * @return How many pages went back
+ */
+size_t slab_release_empty(void) {
+    size_t pages = 0;
+    for (size_t cls = 0; cls < TU_NUM_CLASSES; cls++) {
+        slab *s = PARTIAL[cls] ? PARTIAL[cls]->next : NULL;
+        while (s) {
+            slab *next = s->next;
+            if (s->nfree == s->nslots) {
+                partial_remove(s);
+                CLASS_SLOTS[cls] -= s->nslots;
+                CLASS_FREE[cls] -= s->nslots;
+                pages += s->pages;
+                pages_free(s->chunk, (char *)s, s->pages);
+            }
+            s = next;
+        }
+    }
+    return pages;
+}
+
+/**
+ * Allocate a large block as a run of whole pages from the page heap
+ *
+ * Each chunk's free pages are found with one bitmap run search, instead of
+ * walking the free list for a fit.
+ *
+ * @param size The amount of memory needed, already aligned; main heap lock held by the caller
+ * @return A pointer to the block's memory, or NULL if size takes fewer than
+ *         SPAN_MIN_PAGES or more than SPAN_MAX_PAGES pages, or there is no room
+ */
+void *span_alloc(size_t size) {
+    size_t pages = (SPAN_HEADER + sizeof(free_block) + size + TU_PAGE_SIZE - 1) / TU_PAGE_SIZE;
+    if (pages < SPAN_MIN_PAGES || pages > SPAN_MAX_PAGES) {
+        return NULL;
+    }
+
+    page_chunk *chunk;
+    slab *s = (slab *)pages_alloc(pages, 1, &chunk);
+    if (!s) {
+        return NULL;
+    }
+    s->next = NULL;
+    s->prev = NULL;
+    s->chunk = chunk;
+    s->cls = SPAN_CLASS;
+    s->pages = (uint8_t)pages;
+    s->nslots = 1;
+    s->nfree = 0;
+    s->color = 0;
+
+    free_block *block = (free_block *)((char *)s + SPAN_HEADER);
+    block->size = pages * TU_PAGE_SIZE - SPAN_HEADER - sizeof(free_block);
+    block->next = (free_block *)s;
+    return block + 1;
+}
+
+/**
+ * Hand the free pages of the page heap back to the OS, keeping the address space
+ *
+ * Only runs of at least min bytes go, the same cut purge_locked makes for
+ * free blocks. Nothing lives in a free page, so no bookkeeping changes.
+ *
+ * @param min Smallest run of free pages to purge, main heap lock held by the caller
+ */
+void slab_purge_pages(size_t min) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    for (page_chunk *chunk = CHUNKS; chunk; chunk = chunk->next) {
+        size_t first = 0;
+        while (first < chunk->pages) {
+            if (!(chunk->free_map[first / 64] >> (first % 64) & 1)) {
+                first++;
+                continue;
+            }
+            size_t end = first + 1;
+            while (end < chunk->pages && chunk->free_map[end / 64] >> (end % 64) & 1) {
+                end++;
+            }
+            if ((end - first) * TU_PAGE_SIZE >= min) {
+                uintptr_t start = ((uintptr_t)(chunk->base + first * TU_PAGE_SIZE) + page - 1) & ~(page - 1);
+                uintptr_t stop = (uintptr_t)(chunk->base + end * TU_PAGE_SIZE) & ~(page - 1);
+                if (stop > start) {
+                    madvise((void *)start, stop - start, MADV_DONTNEED);
+                }
+            }
+            first = end;
+        }
+    }
+}
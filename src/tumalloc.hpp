@@ -0,0 +1,203 @@
+#ifndef CYB3053_PROJECT2_TUMALLOC_HPP
+#define CYB3053_PROJECT2_TUMALLOC_HPP
+
+#include "alloc.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace tu {
+
+/**
+ * Default heap alignment; anything stricter goes through the memalign variants
+ */
+inline constexpr std::size_t default_alignment = 16;
+
+/**
+ * Stateless STL allocator backed by the main tumalloc heap
+ */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+
+    template <class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    /**
+     * Allocate room for n objects of type T
+     */
+    T *allocate(std::size_t n) {
+        if (n > static_cast<std::size_t>(-1) / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        std::size_t bytes = n ? n * sizeof(T) : 1;
+        void *ptr = alignof(T) > default_alignment ? tumemalign(alignof(T), bytes) : tumalloc(bytes);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    /**
+     * Release room for n objects, using the sized free path
+     */
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        tufree_sized(ptr, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+/**
+ * Memory resource backed by the main tumalloc heap
+ */
+class main_heap_resource final : public std::pmr::memory_resource {
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void *ptr = tumemalign(alignment, bytes ? bytes : 1);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t) override {
+        tufree_sized(ptr, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const main_heap_resource *>(&other) != nullptr;
+    }
+};
+
+/**
+ * The shared main heap resource
+ */
+inline main_heap_resource *main_heap() noexcept {
+    static main_heap_resource resource;
+    return &resource;
+}
+
+/**
+ * Memory resource owning an independent tuheap
+ *
+ * Everything still allocated from it is released when the resource is
+ * destroyed or release() is called.
+ */
+class heap_resource final : public std::pmr::memory_resource {
+public:
+    heap_resource() : heap_(tuheap_create()) {
+        if (!heap_) {
+            throw std::bad_alloc();
+        }
+    }
+
+    heap_resource(const heap_resource &) = delete;
+    heap_resource &operator=(const heap_resource &) = delete;
+
+    ~heap_resource() override {
+        tuheap_destroy(heap_);
+    }
+
+    /**
+     * Drop every allocation at once and start over with an empty heap
+     */
+    void release() {
+        tuheap *fresh = tuheap_create();
+        if (!fresh) {
+            throw std::bad_alloc();
+        }
+        tuheap_destroy(heap_);
+        heap_ = fresh;
+    }
+
+    tuheap *native_handle() const noexcept {
+        return heap_;
+    }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void *ptr = tuheap_memalign(heap_, alignment, bytes ? bytes : 1);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        tuheap_free(heap_, ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    tuheap *heap_;
+};
+
+/**
+ * Memory resource owning a bump tuarena
+ *
+ * Deallocation is a no-op; reset() releases everything at once. Not
+ * thread-safe, like the arena behind it.
+ */
+class arena_resource final : public std::pmr::memory_resource {
+public:
+    explicit arena_resource(std::size_t chunk_size = 0) : arena_(tuarena_create(chunk_size)) {
+        if (!arena_) {
+            throw std::bad_alloc();
+        }
+    }
+
+    arena_resource(const arena_resource &) = delete;
+    arena_resource &operator=(const arena_resource &) = delete;
+
+    ~arena_resource() override {
+        tuarena_destroy(arena_);
+    }
+
+    /**
+     * Release every allocation; containers using the arena must be gone or cleared first
+     */
+    void reset() noexcept {
+        tuarena_reset(arena_);
+    }
+
+    tuarena *native_handle() const noexcept {
+        return arena_;
+    }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void *ptr = tuarena_alloc(arena_, bytes, alignment);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    tuarena *arena_;
+};
+
+} // namespace tu
+
+#endif //CYB3053_PROJECT2_TUMALLOC_HPP
@@ -0,0 +1,69 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define HEADER 16 /**< An arena chunk's header */
+#define BLOCKS 2000 /**< Enough blocks to fill many chunks */
+
+static size_t size_of(size_t i) {
+    return 1 + (i * 97) % 900;
+}
+
+static int aligned(const void *ptr, size_t alignment) {
+    return (uintptr_t)ptr % alignment == 0;
+}
+
+/**
+ * Bump allocations are aligned and disjoint; sizes and alignments that
+ * cannot be met, including ones whose chunk size would wrap, get NULL and
+ * leave the arena usable; reset keeps serving from the same memory
+ */
+int main(void) {
+    tuarena *arena = tuarena_create(0);
+    CHECK(arena != NULL);
+
+    // Blocks overlapping would overwrite each other's fill
+    static unsigned char *blocks[BLOCKS];
+    for (size_t i = 0; i < BLOCKS; i++) {
+        blocks[i] = tuarena_alloc(arena, size_of(i), (size_t)1 << (i % 13));
+        CHECK(blocks[i] != NULL && aligned(blocks[i], (size_t)1 << (i % 13)));
+        memset(blocks[i], (int)(i & 0xff), size_of(i));
+    }
+    for (size_t i = 0; i < BLOCKS; i++) {
+        for (size_t j = 0; j < size_of(i); j++) {
+            CHECK(blocks[i][j] == (unsigned char)(i & 0xff));
+        }
+    }
+    CHECK(aligned(tuarena_alloc(arena, 8, 0), 16));
+
+    // Oversized requests get a chunk of their own
+    char *big = tuarena_alloc(arena, 1024 * 1024, 4096);
+    CHECK(big != NULL && aligned(big, 4096));
+    memset(big, 1, 1024 * 1024);
+
+    // Alignments that are not a power of two
+    CHECK(tuarena_alloc(arena, 64, 3) == NULL);
+    CHECK(tuarena_alloc(arena, 64, 48) == NULL);
+    CHECK(tuarena_alloc(arena, 64, SIZE_MAX) == NULL);
+
+    // Sizes at and just past what can be counted
+    size_t huge_align = (size_t)1 << (sizeof(size_t) * 8 - 1);
+    CHECK(tuarena_alloc(arena, SIZE_MAX, 0) == NULL);
+    CHECK(tuarena_alloc(arena, SIZE_MAX - 16 - HEADER + 1, 16) == NULL);
+    CHECK(tuarena_alloc(arena, SIZE_MAX - 16 - HEADER, 16) == NULL);
+    CHECK(tuarena_alloc(arena, SIZE_MAX / 2, huge_align) == NULL);
+    CHECK(tuarena_alloc(arena, 64, huge_align) == NULL);
+
+    // Still usable after the failures
+    char *after = tuarena_alloc(arena, 100, 64);
+    CHECK(after != NULL && aligned(after, 64));
+    memset(after, 2, 100);
+
+    tuarena_reset(arena);
+    char *again = tuarena_alloc(arena, 100, 64);
+    CHECK(again != NULL && aligned(again, 64));
+    tuarena_destroy(arena);
+    return 0;
+}
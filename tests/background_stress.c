@@ -0,0 +1,121 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOTS 512 /**< Live blocks the random workload juggles */
+#define ROUNDS 100000 /**< Random allocations or frees per workload */
+#define LARGE_MAX (256 * 1024) /**< Largest random block, well past the small classes */
+#define BIG ((size_t)4 * 1024 * 1024) /**< A free-list block, past the purge threshold */
+#define WAIT_TICKS 500 /**< Ticks (2 ms each) to wait for the maintenance thread */
+
+static uint64_t STATE = 3053; /**< xorshift state, fixed so failures reproduce */
+
+static uint64_t next_random(void) {
+    STATE ^= STATE << 13;
+    STATE ^= STATE >> 7;
+    STATE ^= STATE << 17;
+    return STATE;
+}
+
+/**
+ * Random sizes from tiny to several pages, each block filled with a pattern
+ * that is checked before it is freed
+ *
+ * @param release How to free a block
+ */
+static void churn(void (*release)(void *)) {
+    static unsigned char *slots[SLOTS];
+    static size_t sizes[SLOTS];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t i = next_random() % SLOTS;
+        if (slots[i]) {
+            CHECK(slots[i][0] == (unsigned char)i && slots[i][sizes[i] - 1] == (unsigned char)i);
+            release(slots[i]);
+            slots[i] = NULL;
+            continue;
+        }
+        uint64_t r = next_random();
+        sizes[i] = r & 1 ? 1 + r % 512 : 1 + r % LARGE_MAX;
+        slots[i] = tumalloc(sizes[i]);
+        CHECK(slots[i] != NULL);
+        memset(slots[i], (int)i, sizes[i]);
+    }
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (slots[i]) {
+            release(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Whether the page in the middle of a block is resident
+ */
+static int resident(unsigned char *block, size_t size) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    unsigned char vec;
+    void *mid = (void *)(((uintptr_t)block + size / 2) & ~(page - 1));
+    CHECK(mincore(mid, page, &vec) == 0);
+    return vec & 1;
+}
+
+/**
+ * With the maintenance thread running, frees only push blocks on the free
+ * list. Its ticks, not the sleeping foreground, must then trim the freed
+ * block at the top of the heap and purge the pages of one pinned below a
+ * live block.
+ */
+static void maintenance_gives_back(void) {
+    CHECK(tumalloc_background(2) == 0);
+    unsigned char *low = tumalloc(BIG);
+    unsigned char *pin = tumalloc(BIG);
+    unsigned char *top = tumalloc(BIG);
+    CHECK(low && pin && top && low < pin && pin < top);
+    memset(low, 1, BIG);
+    memset(top, 1, BIG);
+    CHECK(resident(low, BIG));
+    size_t grown = tumalloc_footprint();
+
+    tufree(low);
+    tufree(top);
+    struct timespec tick = { 0, 2 * 1000000 };
+    int trimmed = 0;
+    int purged = 0;
+    for (int i = 0; i < WAIT_TICKS && !(trimmed && purged); i++) {
+        nanosleep(&tick, NULL);
+        trimmed = tumalloc_footprint() <= grown - BIG;
+        purged = !resident(low, BIG);
+    }
+    CHECK(trimmed);
+    CHECK(purged);
+
+    tufree(pin);
+    CHECK(tumalloc_background(0) == 0);
+}
+
+/**
+ * Check that maintenance gives memory back, then stress the heap's
+ * merge-and-trim paths: with the maintenance thread ticking underneath,
+ * and with deferred frees draining in bulk without it
+ */
+int main(void) {
+    maintenance_gives_back();
+    churn(tufree_deferred);
+    tufree_deferred_flush();
+
+    CHECK(tumalloc_background(2) == 0);
+    churn(tufree);
+    churn(tufree_deferred);
+    CHECK(tumalloc_background(0) == 0);
+    struct timespec settle = { 0, 20 * 1000000 };
+    nanosleep(&settle, NULL);
+
+    churn(tufree);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "bitmap.h"
+#include "check.h"
+
+#include <string.h>
+
+#define WORDS 16 /**< As wide as a span chunk's map */
+#define TRIALS 20000 /**< Random maps checked at each width */
+
+static uint64_t STATE = 3053; /**< xorshift state, fixed so failures reproduce */
+
+static uint64_t next_random(void) {
+    STATE ^= STATE << 13;
+    STATE ^= STATE >> 7;
+    STATE ^= STATE << 17;
+    return STATE;
+}
+
+static int bit(const uint64_t *map, size_t i) {
+    return (int)(map[i / 64] >> (i % 64) & 1);
+}
+
+/**
+ * find_set and find_run against a bit-at-a-time search, on random maps
+ * with long runs, and set/clear_range round trips
+ *
+ * @param words Map width; 3 takes the inline loops, 16 the wide kernels
+ */
+static void check_width(size_t words) {
+    for (int t = 0; t < TRIALS; t++) {
+        uint64_t map[WORDS];
+        for (size_t w = 0; w < words; w++) {
+            // Mostly all-free or all-used words, so runs cross word boundaries
+            uint64_t r = next_random();
+            map[w] = r % 4 == 0 ? ~(uint64_t)0 : r % 4 == 1 ? 0 : next_random() & next_random();
+        }
+
+        size_t from = (size_t)(next_random() % words);
+        size_t want = TU_BITMAP_NONE;
+        for (size_t i = from * 64; i < words * 64 && want == TU_BITMAP_NONE; i++) {
+            if (bit(map, i)) {
+                want = i;
+            }
+        }
+        CHECK(tu_bitmap_find_set(map, words, from) == want);
+
+        size_t run = 1 + (size_t)(next_random() % (words * 50));
+        want = TU_BITMAP_NONE;
+        for (size_t i = 0, len = 0; i < words * 64; i++) {
+            len = bit(map, i) ? len + 1 : 0;
+            if (len == run) {
+                want = i + 1 - run;
+                break;
+            }
+        }
+        CHECK(tu_bitmap_find_run(map, words, run) == want);
+
+        if (want != TU_BITMAP_NONE) {
+            tu_bitmap_clear_range(map, want, run);
+            for (size_t i = want; i < want + run; i++) {
+                CHECK(!bit(map, i));
+            }
+            tu_bitmap_set_range(map, want, run);
+            CHECK(tu_bitmap_find_run(map, words, run) == want);
+        }
+    }
+}
+
+int main(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")) {
+        CHECK(strcmp(tu_bitmap_impl(), "avx2") == 0);
+    }
+#endif
+    check_width(3);
+    check_width(WORDS);
+    return 0;
+}
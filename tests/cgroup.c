@@ -0,0 +1,111 @@
+#include "alloc.h"
+#include "check.h"
+#include "internal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MIB ((size_t)1024 * 1024)
+
+static char ROOT[64]; /**< The fake cgroup2 mount point */
+static char LEAF[128]; /**< The process's fake cgroup, two levels below it */
+static char MID[128]; /**< The cgroup between them */
+
+/**
+ * Write a file in a fake cgroup directory, or remove it when text is NULL
+ */
+static void put(const char *dir, const char *name, const char *text) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!text) {
+        unlink(path);
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    CHECK(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    close(fd);
+}
+
+static int tune(void) {
+    return cgroup_tune_dir(LEAF, strlen(ROOT));
+}
+
+static int is_default(void) {
+    return TUNING.purge_ticks == 10 && TUNING.trim_ticks == 10 && TUNING.purge_min == 256 * 1024
+        && TUNING.tcache_fill == TU_TCACHE_CAP && TUNING.grow_step == 0;
+}
+
+/**
+ * The budget is the tightest memory.max or memory.high from the cgroup up to
+ * the mount point; "max" means no limit; missing and malformed files are
+ * skipped; and the share of the budget in use picks the knobs
+ */
+int main(void) {
+    strcpy(ROOT, "/tmp/tumalloc-cgroup-XXXXXX");
+    CHECK(mkdtemp(ROOT) != NULL);
+    snprintf(MID, sizeof(MID), "%s/mid", ROOT);
+    snprintf(LEAF, sizeof(LEAF), "%s/leaf", MID);
+    CHECK(mkdir(MID, 0755) == 0 && mkdir(LEAF, 0755) == 0);
+
+    // No memory.current: no budget, and the defaults stay
+    CHECK(tune() == -1 && is_default());
+
+    // Every limit "max": still no budget
+    put(LEAF, "memory.current", "104857600\n");
+    put(ROOT, "memory.max", "max\n");
+    put(MID, "memory.max", "max\n");
+    put(LEAF, "memory.max", "max\n");
+    put(LEAF, "memory.high", "max\n");
+    CHECK(tune() == -1 && is_default());
+
+    // 100 MiB of an ancestor's 1 GiB: plenty left, big break steps
+    put(MID, "memory.max", "1073741824\n");
+    CHECK(tune() == 0);
+    CHECK(TUNING.purge_ticks == 10 && TUNING.tcache_fill == TU_TCACHE_CAP && TUNING.grow_step == MIB);
+
+    // Malformed and empty files are skipped, not read as far as they parse
+    put(LEAF, "memory.max", "12x\n");
+    put(LEAF, "memory.high", "lots\n");
+    put(MID, "memory.high", "");
+    put(ROOT, "memory.high", "99999999999999999999999\n");
+    put(ROOT, "memory.max", "maximum\n");
+    CHECK(tune() == 0);
+    CHECK(TUNING.purge_ticks == 10 && TUNING.grow_step == MIB);
+
+    // memory.high counts as well as memory.max: 100 of 160 MiB is 62%
+    put(LEAF, "memory.high", "167772160\n");
+    CHECK(tune() == 0);
+    CHECK(TUNING.purge_ticks == 3 && TUNING.purge_min == 64 * 1024);
+    CHECK(TUNING.tcache_fill == TU_TCACHE_CAP / 2 && TUNING.grow_step == 64 * 1024);
+
+    // 100 of 105 MiB at the mount point itself: purge hard, grow exactly
+    put(ROOT, "memory.max", "110100480\n");
+    CHECK(tune() == 0);
+    CHECK(TUNING.purge_ticks == 1 && TUNING.trim_ticks == 1 && TUNING.purge_min == 4 * TU_PAGE_SIZE);
+    CHECK(TUNING.tcache_fill == TU_TCACHE_CAP / 8 && TUNING.grow_step == 0);
+
+    // Limits above the mount point are not read
+    CHECK(cgroup_tune_dir(LEAF, strlen(MID)) == 0);
+    CHECK(TUNING.purge_ticks == 3);
+
+    // A malformed memory.current is no budget, and the defaults come back
+    put(LEAF, "memory.current", "a lot\n");
+    CHECK(tune() == -1 && is_default());
+
+    // A directory that is not there
+    CHECK(cgroup_tune_dir("/nonexistent/cgroup", strlen("/nonexistent")) == -1 && is_default());
+
+    const char *files[] = { "memory.current", "memory.max", "memory.high" };
+    for (size_t i = 0; i < 3; i++) {
+        put(LEAF, files[i], NULL);
+        put(MID, files[i], NULL);
+        put(ROOT, files[i], NULL);
+    }
+    CHECK(rmdir(LEAF) == 0 && rmdir(MID) == 0 && rmdir(ROOT) == 0);
+    return 0;
+}
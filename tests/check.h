@@ -0,0 +1,17 @@
+#ifndef CYB3053_PROJECT2_CHECK_H
+#define CYB3053_PROJECT2_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Fail the test with the file, line and condition unless cond holds
+ */
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#endif //CYB3053_PROJECT2_CHECK_H
@@ -0,0 +1,40 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <pthread.h>
+
+#define ROUNDS 2000 /**< Producer/consumer rounds, each with a new consumer */
+#define BLOCKS 64 /**< Blocks handed over per round */
+#define BLOCK_SIZE 1000 /**< Small enough for the thread cache */
+#define FOOTPRINT_MAX ((size_t)4 * 1024 * 1024) /**< A few MiB; one leaked cache per round adds up to over 100 */
+
+/**
+ * Consumer: only frees what the producer handed over, then exits
+ */
+static void *consumer_main(void *arg) {
+    void **blocks = arg;
+    for (int i = 0; i < BLOCKS; i++) {
+        tufree(blocks[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Blocks freed by a thread that never allocated must go back to the heap
+ * when it exits, or every short-lived consumer leaks a cache's worth
+ */
+int main(void) {
+    void *blocks[BLOCKS];
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < BLOCKS; i++) {
+            blocks[i] = tumalloc(BLOCK_SIZE);
+            CHECK(blocks[i] != NULL);
+        }
+        pthread_t consumer;
+        CHECK(pthread_create(&consumer, NULL, consumer_main, blocks) == 0);
+        CHECK(pthread_join(consumer, NULL) == 0);
+    }
+
+    CHECK(tumalloc_footprint() < FOOTPRINT_MAX);
+    return 0;
+}
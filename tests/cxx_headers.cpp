@@ -0,0 +1,116 @@
+#include "check.h"
+#include "coro_frame.hpp"
+#include "fixed_pool.hpp"
+#include "tumalloc.hpp"
+
+#include <coroutine>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+namespace {
+
+/**
+ * Fill a pmr vector through a resource and check what comes back
+ */
+void use_resource(std::pmr::memory_resource *resource) {
+    std::pmr::vector<int> values(resource);
+    for (int i = 0; i < 10000; i++) {
+        values.push_back(i);
+    }
+    for (int i = 0; i < 10000; i++) {
+        CHECK(values[static_cast<std::size_t>(i)] == i);
+    }
+    void *aligned = resource->allocate(100, 256);
+    CHECK(reinterpret_cast<std::uintptr_t>(aligned) % 256 == 0);
+    resource->deallocate(aligned, 100, 256);
+}
+
+void test_resources() {
+    use_resource(tu::main_heap());
+    CHECK(tu::main_heap()->is_equal(*tu::main_heap()));
+
+    tu::heap_resource heap;
+    use_resource(&heap);
+    CHECK(!heap.is_equal(*tu::main_heap()));
+
+    tu::arena_resource arena(4096);
+    use_resource(&arena);
+    arena.reset();
+    use_resource(&arena);
+
+    std::vector<long, tu::allocator<long>> longs(1000, 7);
+    CHECK(longs[999] == 7);
+}
+
+struct alignas(64) line {
+    int value;
+    explicit line(int v) : value(v) {}
+};
+
+void test_fixed_pool() {
+    tu::fixed_pool<line, 8> pool;
+    static_assert(tu::fixed_pool<line, 8>::slot_size == 64);
+
+    std::vector<line *> lines;
+    for (int i = 0; i < 100; i++) {
+        line *l = pool.create(i);
+        CHECK(reinterpret_cast<std::uintptr_t>(l) % 64 == 0);
+        lines.push_back(l);
+    }
+    for (int i = 0; i < 100; i++) {
+        CHECK(lines[static_cast<std::size_t>(i)]->value == i);
+    }
+    line *last = lines.back();
+    pool.destroy(last);
+    CHECK(pool.create(5) == last);      // the freed slot is the next one out
+    pool.release();
+}
+
+/**
+ * Minimal eager coroutine whose frame comes from the thread's frame cache
+ */
+struct task {
+    struct promise_type : tu::frame_allocated {
+        int value = 0;
+        task get_return_object() {
+            return task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(int v) { value = v; }
+        void unhandled_exception() {}
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+task add(int a, int b) {
+    co_return a + b;
+}
+
+void test_coroutine_frames() {
+    task first = add(2, 3);
+    CHECK(first.handle.done() && first.handle.promise().value == 5);
+    void *frame = first.handle.address();
+    first.handle.destroy();
+
+    // Same size, same thread: the cached frame is reused
+    task second = add(4, 5);
+    CHECK(second.handle.promise().value == 9);
+    CHECK(second.handle.address() == frame);
+    second.handle.destroy();
+}
+
+} // namespace
+
+/**
+ * The C++ headers compiled under C++20 and exercised: pmr resources,
+ * fixed_pool and the coroutine frame cache
+ */
+int main() {
+    test_resources();
+    test_fixed_pool();
+    test_coroutine_frames();
+    return 0;
+}
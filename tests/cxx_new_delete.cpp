@@ -0,0 +1,181 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace {
+
+constexpr std::size_t MIB = 1024 * 1024;
+
+struct Plain {
+    char bytes[200];
+};
+
+struct alignas(64) Line {
+    char bytes[200];
+};
+
+struct alignas(4096) Page {
+    char bytes[5000];
+};
+
+/**
+ * A size no heap can hold, read at run time so the compiler lets it through
+ */
+std::size_t impossible_size() {
+    volatile std::size_t size = SIZE_MAX - 4096;
+    return size;
+}
+
+bool aligned(const void *ptr, std::size_t alignment) {
+    return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0;
+}
+
+/**
+ * Sized delete sends small blocks to the bin of their size, where the next
+ * tumalloc of that size finds them; aligned forms keep their alignment
+ */
+void test_sized_and_aligned() {
+    Plain *plain = new Plain;
+    delete plain;
+    CHECK(tumalloc(sizeof(Plain)) == static_cast<void *>(plain));
+    tufree(plain);
+
+    Plain *plains = new Plain[4];
+    delete[] plains;
+
+    Line *line = new Line;
+    CHECK(aligned(line, 64));
+    delete line;
+    CHECK(tumalloc(sizeof(Line)) == static_cast<void *>(line));
+    tufree(line);
+
+    Line *lines = new Line[3];
+    CHECK(aligned(lines, 64));
+    delete[] lines;
+
+    Page *page = new Page;
+    CHECK(aligned(page, 4096));
+    page->bytes[sizeof(page->bytes) - 1] = 1;
+    delete page;
+
+    void *raw = ::operator new(100, std::align_val_t{256});
+    CHECK(aligned(raw, 256));
+    ::operator delete(raw, 100, std::align_val_t{256});
+    raw = ::operator new[](100, std::align_val_t{8});
+    CHECK(raw != nullptr);
+    ::operator delete[](raw, std::align_val_t{8});
+
+    void *empty = ::operator new(0);
+    void *other = ::operator new(0);
+    CHECK(empty != nullptr && other != nullptr && empty != other);
+    ::operator delete(empty, std::size_t{0});
+    ::operator delete(other);
+}
+
+/**
+ * The nothrow forms allocate like the others and give nullptr instead of
+ * throwing
+ */
+void test_nothrow() {
+    Plain *plain = new (std::nothrow) Plain;
+    CHECK(plain != nullptr);
+    delete plain;
+    Line *lines = new (std::nothrow) Line[2];
+    CHECK(lines != nullptr && aligned(lines, 64));
+    delete[] lines;
+
+    const std::size_t impossible = impossible_size();
+    CHECK(::operator new(impossible, std::nothrow) == nullptr);
+    CHECK(::operator new[](impossible, std::nothrow) == nullptr);
+    CHECK(::operator new(impossible, std::align_val_t{64}, std::nothrow) == nullptr);
+    ::operator delete(nullptr, std::nothrow);
+}
+
+/**
+ * Without a new_handler an impossible size throws std::bad_alloc
+ */
+void test_bad_alloc() {
+    const std::size_t impossible = impossible_size();
+    int thrown = 0;
+    try {
+        void *never = ::operator new(impossible);
+        ::operator delete(never);
+    } catch (const std::bad_alloc &) {
+        thrown++;
+    }
+    try {
+        void *never = ::operator new[](impossible, std::align_val_t{128});
+        ::operator delete[](never, std::align_val_t{128});
+    } catch (const std::bad_alloc &) {
+        thrown++;
+    }
+    CHECK(thrown == 2);
+}
+
+int HANDLER_CALLS = 0;
+
+/**
+ * Frees room the way a new_handler should: here by lifting the hard limit
+ */
+void lift_limit() {
+    HANDLER_CALLS++;
+    CHECK(tumalloc_set_limits(0, 0) == 0);
+}
+
+void give_up() {
+    HANDLER_CALLS++;
+    std::set_new_handler(nullptr);
+}
+
+void throw_bad_alloc() {
+    HANDLER_CALLS++;
+    throw std::bad_alloc();
+}
+
+/**
+ * A failed allocation calls the new_handler and retries until it succeeds,
+ * the handler removes itself, or it throws
+ */
+void test_new_handler() {
+    // The hard limit is tumalloc's, so the failure shows new goes through it
+    CHECK(tumalloc_set_limits(0, tumalloc_footprint() + MIB) == 0);
+    std::set_new_handler(lift_limit);
+    char *big = new char[8 * MIB];
+    CHECK(HANDLER_CALLS == 1);
+    big[8 * MIB - 1] = 1;
+    delete[] big;
+
+    HANDLER_CALLS = 0;
+    CHECK(tumalloc_set_limits(0, tumalloc_footprint() + MIB) == 0);
+    std::set_new_handler(give_up);
+    int thrown = 0;
+    try {
+        big = new char[8 * MIB];
+    } catch (const std::bad_alloc &) {
+        thrown = 1;
+    }
+    CHECK(thrown && HANDLER_CALLS == 1);
+
+    HANDLER_CALLS = 0;
+    std::set_new_handler(throw_bad_alloc);
+    CHECK(new (std::nothrow) char[8 * MIB] == nullptr);
+    CHECK(HANDLER_CALLS == 1);
+    std::set_new_handler(nullptr);
+    CHECK(tumalloc_set_limits(0, 0) == 0);
+}
+
+} // namespace
+
+/**
+ * Every global operator new/delete form linked from tumalloc_cxx
+ */
+int main() {
+    test_sized_and_aligned();
+    test_nothrow();
+    test_bad_alloc();
+    test_new_handler();
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define MIB ((size_t)1024 * 1024)
+#define BATCH 256 /**< Queued blocks a thread drains itself without the maintenance thread */
+#define LARGE (64 * 1024) /**< Past the small classes, so frees would take the heap lock */
+
+static void *exiting_thread(void *arg) {
+    tufree_deferred(arg);
+    return NULL;
+}
+
+/**
+ * Whether a deferred free has reached the heap shows in the footprint: the
+ * blocks sit at the top of the heap, so freeing them trims the break
+ */
+int main(void) {
+    // Small blocks still go to the thread cache when the bin has room
+    void *small = tumalloc(100);
+    tufree_deferred(small);
+    CHECK(tumalloc(100) == small);
+    tufree(small);
+
+    // Queued until flushed
+    size_t base = tumalloc_footprint();
+    void *big = tumalloc(MIB);
+    CHECK(tumalloc_footprint() >= base + MIB);
+    tufree_deferred(big);
+    CHECK(tumalloc_footprint() >= base + MIB);
+    tufree_deferred_flush();
+    CHECK(tumalloc_footprint() < base + MIB);
+
+    // Drained by the thread itself once a batch has piled up
+    static void *blocks[BATCH];
+    base = tumalloc_footprint();
+    for (int i = 0; i < BATCH; i++) {
+        blocks[i] = tumalloc(LARGE);
+        CHECK(blocks[i] != NULL);
+    }
+    size_t full = tumalloc_footprint();
+    for (int i = BATCH - 1; i > 0; i--) {
+        tufree_deferred(blocks[i]);
+    }
+    CHECK(tumalloc_footprint() == full);
+    tufree_deferred(blocks[0]);
+    CHECK(tumalloc_footprint() < base + LARGE);
+
+    // Drained when the thread exits. A first thread leaves a queue behind
+    // for the second to reuse, so making one does not land above the block
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, exiting_thread, tumalloc(LARGE)) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+    base = tumalloc_footprint();
+    big = tumalloc(MIB);
+    CHECK(pthread_create(&thread, NULL, exiting_thread, big) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+    CHECK(tumalloc_footprint() < base + MIB);
+
+    // Drained by the maintenance thread's next tick
+    CHECK(tumalloc_background(5) == 0);
+    base = tumalloc_footprint();
+    big = tumalloc(MIB);
+    tufree_deferred(big);
+    struct timespec tick = { 0, 5 * 1000000 };
+    for (int i = 0; i < 200 && tumalloc_footprint() >= base + MIB; i++) {
+        nanosleep(&tick, NULL);
+    }
+    CHECK(tumalloc_footprint() < base + MIB);
+    CHECK(tumalloc_background(0) == 0);
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WATCHED_SIZE 48 /**< Size of the watched block; churn uses another class */
+#define CHURN_SIZE 256 /**< Blocks retired to push the epoch along */
+#define CHURN 5000 /**< Retirements that would free anything safe several times over */
+#define READERS 2 /**< Reader threads in the stress part */
+#define SWAPS 200000 /**< Nodes the writer publishes and retires */
+#define MAGIC 0x5eed5eed5eed5eedull /**< First word of a live node; a free overwrites it */
+
+static int STAGE = 0; /**< Handshake with the reader thread; atomic */
+
+static void wait_for(int stage) {
+    while (__atomic_load_n(&STAGE, __ATOMIC_ACQUIRE) != stage) {
+        sched_yield();
+    }
+}
+
+static void *reader_main(void *arg) {
+    (void)arg;
+    CHECK(tu_epoch_enter() == 0);
+    CHECK(tu_epoch_enter() == 0);      // nested: only the outer pair counts
+    tu_epoch_exit();
+    __atomic_store_n(&STAGE, 1, __ATOMIC_RELEASE);
+    wait_for(2);
+    tu_epoch_exit();
+    __atomic_store_n(&STAGE, 3, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void churn(void) {
+    for (int i = 0; i < CHURN; i++) {
+        CHECK(tu_retire(tumalloc(CHURN_SIZE)) == 0);
+    }
+}
+
+/**
+ * A retired block stays untouched while a reader that may see it is inside,
+ * and is freed once the reader leaves
+ */
+static void retire_waits_for_reader(void) {
+    uint64_t *watched = tumalloc(WATCHED_SIZE);
+    CHECK(watched != NULL);
+    for (size_t i = 0; i < WATCHED_SIZE / 8; i++) {
+        watched[i] = MAGIC;
+    }
+
+    pthread_t reader;
+    CHECK(pthread_create(&reader, NULL, reader_main, NULL) == 0);
+    wait_for(1);
+
+    CHECK(tu_retire(watched) == 0);
+    churn();
+    // Freeing links the block into a cache through its first word
+    CHECK(watched[0] == MAGIC);
+
+    __atomic_store_n(&STAGE, 2, __ATOMIC_RELEASE);
+    wait_for(3);
+    pthread_join(reader, NULL);
+    churn();
+    CHECK(watched[0] != MAGIC);
+}
+
+typedef struct node {
+    uint64_t magic; /**< MAGIC while the node is live */
+    uint64_t value; /**< Anything */
+} node;
+
+static node *SHARED = NULL; /**< The published node; atomic */
+static int DONE = 0; /**< Set when the writer has finished; atomic */
+static size_t BAD_READS = 0; /**< Reads that saw a freed node; atomic */
+
+static void *stress_reader(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&DONE, __ATOMIC_ACQUIRE)) {
+        CHECK(tu_epoch_enter() == 0);
+        node *n = __atomic_load_n(&SHARED, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < 64; i++) {
+            if (__atomic_load_n(&n->magic, __ATOMIC_RELAXED) != MAGIC) {
+                __atomic_fetch_add(&BAD_READS, 1, __ATOMIC_RELAXED);
+            }
+        }
+        tu_epoch_exit();
+    }
+    return NULL;
+}
+
+/**
+ * Readers never see a node freed under them while a writer keeps swapping
+ * and retiring the published one
+ */
+static void swap_stress(void) {
+    node *first = tumalloc(sizeof(node));
+    first->magic = MAGIC;
+    __atomic_store_n(&SHARED, first, __ATOMIC_RELEASE);
+
+    pthread_t readers[READERS];
+    for (int i = 0; i < READERS; i++) {
+        CHECK(pthread_create(&readers[i], NULL, stress_reader, NULL) == 0);
+    }
+    for (int i = 0; i < SWAPS; i++) {
+        node *fresh = tumalloc(sizeof(node));
+        CHECK(fresh != NULL);
+        fresh->magic = MAGIC;
+        fresh->value = (uint64_t)i;
+        node *old = __atomic_exchange_n(&SHARED, fresh, __ATOMIC_ACQ_REL);
+        CHECK(tu_retire(old) == 0);
+    }
+    __atomic_store_n(&DONE, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    tufree(SHARED);
+    CHECK(BAD_READS == 0);
+}
+
+int main(void) {
+    retire_waits_for_reader();
+    swap_stress();
+    return 0;
+}
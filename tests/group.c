@@ -0,0 +1,127 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIB ((size_t)1024 * 1024)
+#define GROUPS 64 /**< Groups live at once */
+#define OBJECTS 5 /**< Objects per group */
+#define SENTINEL ((void *)(uintptr_t)0x5a5a5a5a) /**< Marks output entries the call must overwrite */
+
+static const size_t ALIGNS[OBJECTS] = { 0, 64, 8, 4096, 0 };
+
+static size_t size_of(size_t group, size_t obj) {
+    return 1 + (group * 131 + obj * 977) % 3000;
+}
+
+/**
+ * Make a group, checking each object's alignment and that the objects sit
+ * in order inside the block without overlapping, then fill them
+ */
+static void *make_group(size_t g, void **out) {
+    size_t sizes[OBJECTS];
+    for (size_t i = 0; i < OBJECTS; i++) {
+        sizes[i] = size_of(g, i);
+        out[i] = SENTINEL;
+    }
+    char *base = tumalloc_group(OBJECTS, sizes, ALIGNS, out);
+    CHECK(base != NULL && out[0] == base);
+
+    char *end = base + tumalloc_usable_size(base);
+    for (size_t i = 0; i < OBJECTS; i++) {
+        size_t align = ALIGNS[i] ? ALIGNS[i] : 16;
+        CHECK((uintptr_t)out[i] % align == 0);
+        CHECK((char *)out[i] + sizes[i] <= end);
+        if (i > 0) {
+            CHECK((char *)out[i - 1] + sizes[i - 1] <= (char *)out[i]);
+        }
+        memset(out[i], (int)((g * OBJECTS + i) & 0xff), sizes[i]);
+    }
+    return base;
+}
+
+static void check_group(size_t g, void **out) {
+    for (size_t i = 0; i < OBJECTS; i++) {
+        const unsigned char *p = out[i];
+        for (size_t j = 0; j < size_of(g, i); j++) {
+            CHECK(p[j] == (unsigned char)((g * OBJECTS + i) & 0xff));
+        }
+    }
+}
+
+static void check_cleared(void **out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        CHECK(out[i] == NULL);
+    }
+}
+
+/**
+ * Objects are aligned and disjoint, each group is freed on its own without
+ * touching the others, and a call that fails anywhere allocates nothing and
+ * leaves every output entry NULL
+ */
+int main(void) {
+    static void *out[GROUPS][OBJECTS];
+    static void *base[GROUPS];
+    for (size_t g = 0; g < GROUPS; g++) {
+        base[g] = make_group(g, out[g]);
+    }
+
+    // Free every other group and reuse the room; the rest are untouched
+    for (size_t g = 0; g < GROUPS; g += 2) {
+        tufree(base[g]);
+    }
+    for (size_t g = 0; g < GROUPS; g += 2) {
+        base[g] = make_group(g, out[g]);
+    }
+    for (size_t g = 0; g < GROUPS; g++) {
+        check_group(g, out[g]);
+    }
+    for (size_t g = 0; g < GROUPS; g++) {
+        tufree(base[g]);
+    }
+
+    // No alignments given: every object gets the default 16
+    size_t plain[3] = { 3, 40, 1 };
+    void *ptrs[3];
+    void *block = tumalloc_group(3, plain, NULL, ptrs);
+    CHECK(block == ptrs[0]);
+    for (size_t i = 0; i < 3; i++) {
+        CHECK((uintptr_t)ptrs[i] % 16 == 0);
+    }
+    tufree(block);
+
+    // Failures partway through the list: a bad alignment, an object too
+    // big, a total too big, and a heap that cannot grow
+    size_t before = tumalloc_footprint();
+    size_t sizes[4] = { 64, 64, 64, 64 };
+    size_t aligns[4] = { 0, 32, 48, 0 };
+    void *fail[4] = { SENTINEL, SENTINEL, SENTINEL, SENTINEL };
+    CHECK(tumalloc_group(4, sizes, aligns, fail) == NULL);
+    check_cleared(fail, 4);
+
+    sizes[3] = SIZE_MAX / 2;
+    aligns[2] = 0;
+    fail[0] = fail[3] = SENTINEL;
+    CHECK(tumalloc_group(4, sizes, aligns, fail) == NULL);
+    check_cleared(fail, 4);
+
+    sizes[1] = sizes[2] = (size_t)PTRDIFF_MAX / 3;
+    sizes[3] = 64;
+    fail[0] = fail[1] = SENTINEL;
+    CHECK(tumalloc_group(4, sizes, aligns, fail) == NULL);
+    check_cleared(fail, 4);
+    CHECK(tumalloc_footprint() == before);
+
+    CHECK(tumalloc_set_limits(0, before + MIB) == 0);
+    sizes[1] = sizes[2] = 4 * MIB;
+    fail[0] = fail[2] = SENTINEL;
+    CHECK(tumalloc_group(4, sizes, aligns, fail) == NULL);
+    check_cleared(fail, 4);
+    CHECK(tumalloc_footprint() <= before + MIB);
+    CHECK(tumalloc_set_limits(0, 0) == 0);
+
+    CHECK(tumalloc_group(0, sizes, aligns, fail) == NULL);
+    return 0;
+}
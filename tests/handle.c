@@ -0,0 +1,171 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <string.h>
+
+#define HANDLES 4000 /**< Enough blocks to span several segments */
+#define GAP_HANDLES 1200 /**< Blocks of GAP_SIZE, enough for four segments */
+#define GAP_SIZE 1008 /**< A size already aligned, so blocks sit back to back */
+#define BLOCK_HEADER 16 /**< A movable block's header */
+#define SEGMENT_HEADER (32 + BLOCK_HEADER) /**< From a segment to its first block */
+#define SEGMENT_SIZE (32 + 256 * 1024) /**< What a segment takes from the main heap */
+#define DEAD_HANDLES 4096 /**< Dead blocks for one pass to scan */
+
+static size_t size_of(size_t i) {
+    return 16 + (i * 37) % 2000;
+}
+
+/**
+ * Fill a handle's block with a pattern derived from its index
+ */
+static void fill(tuhandle h, size_t i) {
+    unsigned char *p = tuhandle_lock(h);
+    CHECK(p != NULL);
+    memset(p, (int)(i & 0xff), size_of(i));
+    tuhandle_unlock(h);
+}
+
+static void check(tuhandle h, size_t i) {
+    CHECK(tuhandle_size(h) == size_of(i));
+    unsigned char *p = tuhandle_lock(h);
+    CHECK(p != NULL);
+    for (size_t j = 0; j < size_of(i); j++) {
+        CHECK(p[j] == (unsigned char)(i & 0xff));
+    }
+    tuhandle_unlock(h);
+}
+
+/**
+ * Segments a pass empties in front of a pinned block go back to the main
+ * heap right away: the next allocation of a segment's size reuses them
+ */
+static void pinned_gap_gives_back(void) {
+    static tuhandle gap[GAP_HANDLES];
+    static char *at[GAP_HANDLES];
+    size_t starts[4];
+    size_t nstarts = 0;
+    for (size_t i = 0; i < GAP_HANDLES; i++) {
+        gap[i] = tuhandle_alloc(GAP_SIZE);
+        CHECK(gap[i] != 0);
+        at[i] = tuhandle_lock(gap[i]);
+        tuhandle_unlock(gap[i]);
+        if (i == 0 || at[i] != at[i - 1] + GAP_SIZE + BLOCK_HEADER) {
+            if (nstarts < 4) {
+                starts[nstarts++] = i;
+            }
+        }
+    }
+    CHECK(nstarts == 4);
+
+    // The first two segments die, the third is held by its first block
+    for (size_t i = 0; i < starts[2]; i++) {
+        tuhandle_free(gap[i]);
+        gap[i] = 0;
+    }
+    char *pinned_at = tuhandle_lock(gap[starts[2]]);
+    CHECK(tuheap_compact(0) == 1);
+    CHECK(tuhandle_lock(gap[starts[2]]) == pinned_at);
+
+    char *from = at[starts[0]] - SEGMENT_HEADER;
+    char *to = at[starts[2]] - SEGMENT_HEADER;
+    char *probe = tumalloc(SEGMENT_SIZE);
+    CHECK(probe >= from && probe < to);
+    tufree(probe);
+
+    tuhandle_unlock(gap[starts[2]]);
+    tuhandle_unlock(gap[starts[2]]);
+    CHECK(tuheap_compact(0) == 1);
+    for (size_t i = starts[2]; i < GAP_HANDLES; i++) {
+        tuhandle_free(gap[i]);
+    }
+    CHECK(tuheap_compact(0) == 1);
+}
+
+/**
+ * The budget counts blocks looked at, not blocks moved: a pass over dead
+ * blocks stops and resumes like any other
+ */
+static void dead_blocks_use_budget(void) {
+    static tuhandle dead[DEAD_HANDLES];
+    for (size_t i = 0; i < DEAD_HANDLES; i++) {
+        dead[i] = tuhandle_alloc(16);
+        CHECK(dead[i] != 0);
+    }
+    for (size_t i = 0; i + 1 < DEAD_HANDLES; i++) {
+        tuhandle_free(dead[i]);
+    }
+    CHECK(tuheap_compact(1) == 0);
+    int calls = 1;
+    while (!tuheap_compact(1)) {
+        calls++;
+    }
+    CHECK(calls >= DEAD_HANDLES / 32);
+    tuhandle_free(dead[DEAD_HANDLES - 1]);
+    CHECK(tuheap_compact(0) == 1);
+}
+
+/**
+ * Contents survive compaction, pinned blocks stay put, and a pass over
+ * dead blocks packs movable space back to its start
+ */
+int main(void) {
+    pinned_gap_gives_back();
+    dead_blocks_use_budget();
+
+    static tuhandle handles[HANDLES];
+    for (size_t i = 0; i < HANDLES; i++) {
+        handles[i] = tuhandle_alloc(size_of(i));
+        CHECK(handles[i] != 0);
+        fill(handles[i], i);
+    }
+    void *first_at = tuhandle_lock(handles[0]);
+    tuhandle_unlock(handles[0]);
+    CHECK(tuhandle_lock(0) == NULL);
+    CHECK(tuhandle_size(HANDLES * 10) == 0);
+
+    // Free two of every three, and pin one block in the middle across the pass
+    for (size_t i = 0; i < HANDLES; i++) {
+        if (i % 3) {
+            tuhandle_free(handles[i]);
+            handles[i] = 0;
+        }
+    }
+    CHECK(tuhandle_lock(handles[1]) == NULL);
+    size_t pinned = HANDLES / 2 - (HANDLES / 2) % 3;
+    void *pinned_at = tuhandle_lock(handles[pinned]);
+    CHECK(pinned_at != NULL);
+
+    // A tiny budget makes the pass resume over several calls
+    int calls = 0;
+    while (!tuheap_compact(1000)) {
+        calls++;
+        CHECK(calls < 1000000);
+    }
+    CHECK(tuhandle_lock(handles[pinned]) == pinned_at);
+    tuhandle_unlock(handles[pinned]);
+    tuhandle_unlock(handles[pinned]);
+
+    for (size_t i = 0; i < HANDLES; i++) {
+        if (handles[i]) {
+            check(handles[i], i);
+        }
+    }
+
+    // Unpinned now: a full pass slides everything down and stays correct
+    CHECK(tuheap_compact(0) == 1);
+    for (size_t i = 0; i < HANDLES; i++) {
+        if (handles[i]) {
+            check(handles[i], i);
+            tuhandle_free(handles[i]);
+        }
+    }
+
+    // With every block dead, the next block starts where the first one did
+    CHECK(tuheap_compact(0) == 1);
+    tuhandle again = tuhandle_alloc(16);
+    CHECK(again != 0);
+    CHECK(tuhandle_lock(again) == first_at);
+    tuhandle_unlock(again);
+    tuhandle_free(again);
+    return 0;
+}
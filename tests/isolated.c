@@ -0,0 +1,75 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define ROUNDS 20000 /**< Allocate/free rounds of the leak check */
+#define LIVE 64 /**< Isolated blocks kept at once */
+
+static size_t round_up(size_t size, size_t line) {
+    return (size + line - 1) / line * line;
+}
+
+/**
+ * Allocate an isolated block and check it owns whole lines: it starts on a
+ * line, and the rest of its last line is padding inside the block
+ */
+static unsigned char *isolated(size_t size, size_t line) {
+    unsigned char *p = tumalloc_isolated(size, line);
+    size_t want = line ? line : TU_CACHE_LINE;
+    CHECK(p != NULL);
+    CHECK((uintptr_t)p % want == 0);
+    CHECK(tumalloc_usable_size(p) >= round_up(size, want));
+    memset(p, 0x5a, round_up(size, want));
+    return p;
+}
+
+/**
+ * Blocks start on a line and are padded to whole lines for small and large
+ * sizes, neighbours never share a line, a line that is not a power of two
+ * is refused, and tufree takes isolated blocks back
+ */
+int main(void) {
+    static const size_t sizes[] = { 1, 8, 63, 64, 65, 100, 500, 1000, 1024, 1025, 5000, 70000 };
+    static const size_t lines[] = { 0, 16, 64, 128, 256, 4096 };
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            tufree(isolated(sizes[s], lines[l]));
+        }
+    }
+
+    // Two neighbours: neither the other's data nor its header is in our lines
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned char *a = isolated(sizes[s], 128);
+        unsigned char *b = isolated(sizes[s], 128);
+        unsigned char *a_end = a + round_up(sizes[s], 128);
+        unsigned char *b_end = b + round_up(sizes[s], 128);
+        CHECK(b - sizeof(free_block) >= a_end || b_end <= a - sizeof(free_block));
+        tufree(a);
+        tufree(b);
+    }
+
+    // Lines that are not a power of two, and sizes that cannot be met
+    CHECK(tumalloc_isolated(64, 48) == NULL);
+    CHECK(tumalloc_isolated(64, 100) == NULL);
+    CHECK(tumalloc_isolated(0, 64) == NULL);
+    CHECK(tumalloc_isolated(SIZE_MAX - 8, 64) == NULL);
+
+    // Freeing them gives the memory back: the footprint settles
+    static unsigned char *live[LIVE];
+    size_t settled = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t i = (size_t)round % LIVE;
+        tufree(live[i]);
+        live[i] = isolated(sizes[(size_t)round % 12], lines[(size_t)round % 6]);
+        if (round == ROUNDS / 2) {
+            settled = tumalloc_footprint();
+        }
+    }
+    CHECK(tumalloc_footprint() <= settled + 1024 * 1024);
+    for (size_t i = 0; i < LIVE; i++) {
+        tufree(live[i]);
+    }
+    return 0;
+}
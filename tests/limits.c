@@ -0,0 +1,77 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <unistd.h>
+
+#define MIB ((size_t)1024 * 1024)
+#define BLOCK (100 * 1000) /**< Past the small classes */
+
+/**
+ * The hard limit is never crossed, the footprint comes back down as blocks
+ * are freed and follows the break when other code moves it, and crossing
+ * the soft limit reclaims memory still held back
+ */
+int main(void) {
+    static void *live[256];
+    CHECK(tumalloc_set_limits(2 * MIB, MIB) == -1);
+
+    // Make this thread's deferred-free queue now, so its slab sits below
+    // everything the test measures instead of pinning the top of the heap
+    tufree_deferred(tumalloc(BLOCK));
+    tufree_deferred_flush();
+
+    // Hard limit: allocation stops at it, and freeing gives it all back
+    size_t base = tumalloc_footprint();
+    size_t hard = base + 8 * MIB;
+    CHECK(tumalloc_set_limits(0, hard) == 0);
+    size_t n = 0;
+    while ((live[n] = tumalloc(BLOCK)) != NULL) {
+        CHECK(tumalloc_footprint() <= hard);
+        n++;
+    }
+    CHECK(n >= 8 * MIB / BLOCK - 2);
+    CHECK(tumalloc_footprint() > hard - BLOCK - 64);
+    for (size_t i = 0; i < n; i++) {
+        tufree(live[i]);
+    }
+    CHECK(tumalloc_footprint() <= base);
+
+    // Lifting the limit lets the heap grow again
+    CHECK(tumalloc_set_limits(0, 0) == 0);
+    void *big = tumalloc(16 * MIB);
+    CHECK(big != NULL);
+    tufree(big);
+    CHECK(tumalloc_footprint() <= base);
+
+    // Other code that leaves the break unaligned and later puts it back
+    // (brk to a saved address) leaves no padding counted in the footprint
+    size_t before = tumalloc_footprint();
+    for (int i = 0; i < 64; i++) {
+        char *saved = sbrk(0);
+        CHECK(sbrk(8) != (void *)-1);
+        tufree(tumalloc(16 * MIB));
+        CHECK(brk(saved) == 0);
+    }
+    tufree(tumalloc(16 * MIB));
+    CHECK(tumalloc_footprint() == before);
+
+    // Soft limit: blocks parked on the deferred-free queue stay allocated
+    // until growing past the limit makes the next slow path reclaim them
+    CHECK(tumalloc_set_limits(base + 4 * MIB, 0) == 0);
+    n = 3 * MIB / BLOCK;
+    for (size_t i = 0; i < n; i++) {
+        live[i] = tumalloc(BLOCK);
+        CHECK(live[i] != NULL);
+    }
+    for (size_t i = 0; i < n; i++) {
+        tufree_deferred(live[i]);
+    }
+    size_t parked = tumalloc_footprint();
+    CHECK(parked > base + 2 * MIB && parked <= base + 4 * MIB);     // under the limit so far
+    tufree(tumalloc(2 * MIB));      // grows past the soft limit
+    CHECK(tumalloc_footprint() >= parked);
+    tufree(tumalloc(BLOCK));        // reclaims first
+    CHECK(tumalloc_footprint() < base + MIB);
+    CHECK(tumalloc_set_limits(0, 0) == 0);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include "check.h"
+#include "memkern.h"
+
+#include <string.h>
+
+#define GUARD 64 /**< Bytes on each side that must stay untouched */
+#define MAX_N 600 /**< Longest block tried, a few times the widest store loop */
+
+static unsigned char DST[GUARD + 64 + MAX_N + GUARD];
+static unsigned char SRC[64 + MAX_N];
+
+/**
+ * The streaming kernels on every short length at every misalignment,
+ * including blocks shorter than the bytes needed to align them
+ */
+int main(void) {
+    for (size_t i = 0; i < sizeof(SRC); i++) {
+        SRC[i] = (unsigned char)(i * 7 + 1);
+    }
+
+    for (size_t off = 0; off < 64; off++) {
+        for (size_t n = 0; n <= MAX_N; n++) {
+            unsigned char *d = DST + GUARD + off;
+
+            memset(DST, 0xA5, sizeof(DST));
+            tu_memzero_stream(d, n);
+            for (size_t i = 0; i < sizeof(DST); i++) {
+                int inside = DST + i >= d && DST + i < d + n;
+                CHECK(DST[i] == (inside ? 0 : 0xA5));
+            }
+
+            memset(DST, 0xA5, sizeof(DST));
+            tu_memcopy_stream(d, SRC + off, n);
+            for (size_t i = 0; i < sizeof(DST); i++) {
+                int inside = DST + i >= d && DST + i < d + n;
+                CHECK(DST[i] == (inside ? SRC[off + (size_t)(DST + i - d)] : 0xA5));
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define BLOCKS 400 /**< Enough blocks of one class to fill a few slabs */
+#define SIZE 200 /**< A small class */
+#define LARGE (8 * 1024) /**< Past the small classes, below a span: a free-list block */
+
+static void *BLOCK[BLOCKS];
+
+static void *slab_of(void *ptr) {
+    return ((free_block *)ptr - 1)->next;
+}
+
+/**
+ * Free every other block of keep's slab from a thread whose exit flushes
+ * them back to the slab
+ */
+static void *free_slab_main(void *arg) {
+    size_t keep = *(size_t *)arg;
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (i != keep && BLOCK[i] && slab_of(BLOCK[i]) == slab_of(BLOCK[keep])) {
+            tufree(BLOCK[i]);
+            BLOCK[i] = NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * A hint in a slab with free slots gets a block from that slab; NULL and
+ * foreign hints get a plain allocation; large sizes ignore the hint
+ */
+int main(void) {
+    for (size_t i = 0; i < BLOCKS; i++) {
+        BLOCK[i] = tumalloc(SIZE);
+        CHECK(BLOCK[i] != NULL);
+    }
+
+    // Empty out the first slab but its first block, away from this thread's cache
+    size_t keep = 0;
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, free_slab_main, &keep) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+    void *hint = BLOCK[keep];
+
+    void *plain = tumalloc(SIZE);
+    CHECK(plain != NULL && slab_of(plain) != slab_of(hint));
+    void *near = tumalloc_near(hint, SIZE);
+    CHECK(near != NULL && slab_of(near) == slab_of(hint));
+    CHECK((char *)near > (char *)hint);
+    void *nearer = tumalloc_near(near, SIZE);
+    CHECK(nearer != NULL && slab_of(nearer) == slab_of(hint));
+    CHECK((char *)nearer > (char *)near);
+
+    // NULL and foreign hints: nothing of theirs is read, the allocation still happens
+    static unsigned char junk[256];
+    memset(junk, 0xab, sizeof(junk));
+    int local = 0;
+    tuheap *heap = tuheap_create();
+    CHECK(heap != NULL);
+    void *from_heap = tuheap_alloc(heap, SIZE);
+    CHECK(from_heap != NULL);
+    void *foreign[] = { NULL, junk + 128, &local, from_heap };
+    for (size_t i = 0; i < sizeof(foreign) / sizeof(foreign[0]); i++) {
+        unsigned char *p = tumalloc_near(foreign[i], SIZE);
+        CHECK(p != NULL && tumalloc_usable_size(p) >= SIZE);
+        memset(p, 1, SIZE);
+        tufree(p);
+    }
+    tuheap_destroy(heap);
+    CHECK(tumalloc_near(hint, 0) == NULL);
+
+    // Large sizes take what tumalloc would, the head of the free list,
+    // not the free block right next to the hint
+    void *big_hint = tumalloc(LARGE);
+    void *next_to_hint = tumalloc(LARGE);
+    void *sep1 = tumalloc(LARGE);
+    void *filler = tumalloc(1024 * 1024);
+    void *far = tumalloc(LARGE);
+    void *sep2 = tumalloc(LARGE);
+    CHECK(big_hint && next_to_hint && sep1 && filler && far && sep2);
+    tufree(next_to_hint);
+    tufree(far);
+    CHECK(tumalloc_near(big_hint, LARGE) == far);
+    return 0;
+}
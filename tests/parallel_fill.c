@@ -0,0 +1,113 @@
+#include "alloc.h"
+#include "check.h"
+#include "memkern.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MIB ((size_t)1024 * 1024)
+#define GUARD 64 /**< Bytes on each side that must stay untouched */
+#define FORKS 20 /**< Forks taken while another thread keeps the pool busy */
+
+static int STOP = 0; /**< Tells the filler thread to finish; atomic */
+
+/**
+ * Keep zeroing a huge block through the pool until told to stop
+ */
+static void *filler_main(void *arg) {
+    unsigned char *block = arg;
+    while (!__atomic_load_n(&STOP, __ATOMIC_RELAXED)) {
+        tu_fill_parallel(block, NULL, 8 * MIB);
+    }
+    return NULL;
+}
+
+/**
+ * Fork while another thread runs fills; each child must be able to run
+ * one of its own, with new workers
+ */
+static void fork_during_fill(void) {
+    unsigned char *block = tumalloc(8 * MIB);
+    CHECK(block != NULL);
+    CHECK(tumalloc_parallel_fill(2, 4 * MIB) == 0);
+    pthread_t filler;
+    CHECK(pthread_create(&filler, NULL, filler_main, block) == 0);
+
+    for (int i = 0; i < FORKS; i++) {
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (pid == 0) {
+            memset(block, 0xA5, 8 * MIB);
+            int ok = tu_fill_parallel(block, NULL, 8 * MIB) == 1 && block[0] == 0 && block[8 * MIB - 1] == 0;
+            _exit(ok ? 0 : 1);
+        }
+        int status;
+        CHECK(waitpid(pid, &status, 0) == pid);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    __atomic_store_n(&STOP, 1, __ATOMIC_RELAXED);
+    pthread_join(filler, NULL);
+    tufree(block);
+}
+
+/**
+ * Zero and copy through the pool at awkward lengths and offsets: blocks that
+ * end just past a slice boundary, start just before one, or are barely over
+ * the threshold
+ */
+int main(void) {
+    static const size_t extra[] = { 0, 1, 16, 32, 48, 4095, 2 * MIB - 1, 2 * MIB + 1 };
+    size_t cap = 24 * MIB;
+    unsigned char *src = tumalloc(cap);
+    unsigned char *buf = tumalloc(cap + 2 * MIB + 2 * GUARD);
+    CHECK(src && buf);
+    for (size_t i = 0; i < cap; i++) {
+        src[i] = (unsigned char)(i * 131 + 7);
+    }
+
+    CHECK(tumalloc_parallel_fill(2, 4 * MIB) == 0);
+    for (size_t e = 0; e < sizeof(extra) / sizeof(extra[0]); e++) {
+        // Start 0, 16 bytes and 16 bytes short of a 2 MiB boundary in
+        size_t lead = (size_t)(-(uintptr_t)(buf + GUARD)) & (2 * MIB - 1);
+        size_t starts[] = { lead, lead + 16, lead + 2 * MIB - 16 };
+        for (size_t s = 0; s < 3; s++) {
+            size_t n = 16 * MIB + extra[e];
+            unsigned char *d = buf + GUARD + starts[s] % (2 * MIB);
+
+            memset(buf, 0xA5, cap + 2 * MIB + 2 * GUARD);
+            CHECK(tu_fill_parallel(d, NULL, n) == 1);
+            for (size_t i = 0; i < n; i++) {
+                CHECK(d[i] == 0);
+            }
+            CHECK(d[-1] == 0xA5 && d[n] == 0xA5);
+
+            CHECK(tu_fill_parallel(d, src, n) == 1);
+            CHECK(memcmp(d, src, n) == 0);
+            CHECK(d[-1] == 0xA5 && d[n] == 0xA5);
+        }
+    }
+
+    // The sizes that used to overrun through tucalloc, at the default threshold
+    CHECK(tumalloc_parallel_fill(1, 0) == 0);
+    for (size_t e = 1; e < 5; e++) {
+        size_t n = 112 * MIB + extra[e];
+        unsigned char *p = tucalloc(1, n);
+        CHECK(p != NULL);
+        for (size_t i = 0; i < n; i += 4093) {
+            CHECK(p[i] == 0);
+        }
+        CHECK(p[n - 1] == 0);
+        tufree(p);
+    }
+
+    fork_during_fill();
+
+    CHECK(tumalloc_parallel_fill(0, 0) == 0);
+    tufree(buf);
+    tufree(src);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include "check.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCKS 500 /**< Live blocks in the churn */
+#define ROUNDS 50000 /**< Calls in the churn */
+#define LARGE_MAX (96 * 1024) /**< Largest block in the churn, past the small classes and spans */
+#define EARLY 16 /**< Blocks from libc's allocator */
+
+// glibc's own allocator, standing in for whatever ran before the library took over
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+
+static uint64_t STATE = 3053; /**< xorshift state, fixed so failures reproduce */
+
+static uint64_t next_random(void) {
+    STATE ^= STATE << 13;
+    STATE ^= STATE >> 7;
+    STATE ^= STATE << 17;
+    return STATE;
+}
+
+static void check_fill(const unsigned char *p, size_t size, unsigned char value) {
+    for (size_t i = 0; i < size; i++) {
+        CHECK(p[i] == value);
+    }
+}
+
+/**
+ * Mixed malloc, calloc, realloc, posix_memalign and free, each block
+ * filled with a pattern that is checked before it changes hands
+ */
+static void churn(void) {
+    static unsigned char *slots[BLOCKS];
+    static size_t sizes[BLOCKS];
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t i = next_random() % BLOCKS;
+        uint64_t r = next_random();
+        size_t size = r & 1 ? 1 + r % 700 : 1 + r % LARGE_MAX;
+        unsigned char mark = (unsigned char)(i + 1);
+        if (slots[i]) {
+            check_fill(slots[i], sizes[i], mark);
+            if (r % 3 == 0) {
+                slots[i] = realloc(slots[i], size);
+                CHECK(slots[i] != NULL);
+                check_fill(slots[i], size < sizes[i] ? size : sizes[i], mark);
+                memset(slots[i], mark, size);
+                sizes[i] = size;
+            }
+            else {
+                free(slots[i]);
+                slots[i] = NULL;
+            }
+            continue;
+        }
+        switch (r % 4) {
+        case 0:
+            slots[i] = malloc(size);
+            break;
+        case 1:
+            slots[i] = calloc(1, size);
+            CHECK(slots[i] != NULL);
+            check_fill(slots[i], size, 0);
+            break;
+        case 2: {
+            size_t align = (size_t)8 << (r % 10);
+            void *p = NULL;
+            CHECK(posix_memalign(&p, align, size) == 0);
+            CHECK((uintptr_t)p % align == 0);
+            slots[i] = p;
+            break;
+        }
+        default:
+            slots[i] = realloc(NULL, size);
+            break;
+        }
+        CHECK(slots[i] != NULL);
+        memset(slots[i], mark, size);
+        sizes[i] = size;
+    }
+    for (size_t i = 0; i < BLOCKS; i++) {
+        free(slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+/**
+ * Run with libtumalloc_preload.so in LD_PRELOAD: the libc entry points are
+ * the library's, behave as libc's do, and take blocks from libc's own
+ * allocator (made before the library did anything) back to it
+ */
+int main(void) {
+    // Before anything else touches the heap
+    unsigned char *early[EARLY];
+    for (size_t i = 0; i < EARLY; i++) {
+        size_t size = i % 4 == 3 ? 512 * 1024 : 24 + i * 40;
+        early[i] = i % 2 ? __libc_calloc(1, size) : __libc_malloc(size);
+        CHECK(early[i] != NULL);
+        memset(early[i], (int)(0xa0 + i), size);
+    }
+
+    Dl_info info;
+    CHECK(dladdr((void *)(uintptr_t)&malloc, &info) != 0);
+    CHECK(info.dli_fname && strstr(info.dli_fname, "tumalloc_preload") != NULL);
+
+    churn();
+
+    // calloc zeroes reused memory, and rejects overflowing sizes
+    unsigned char *dirty = malloc(4096);
+    CHECK(dirty != NULL);
+    memset(dirty, 0xff, 4096);
+    free(dirty);
+    unsigned char *zeroed = calloc(64, 64);
+    CHECK(zeroed != NULL);
+    check_fill(zeroed, 4096, 0);
+    free(zeroed);
+    volatile size_t huge = SIZE_MAX / 2;
+    errno = 0;
+    CHECK(calloc(huge, 4) == NULL && errno == ENOMEM);
+
+    // posix_memalign and realloc edge cases
+    void *p = NULL;
+    CHECK(posix_memalign(&p, 24, 64) == EINVAL);
+    CHECK(posix_memalign(&p, 4, 64) == EINVAL);
+    CHECK(posix_memalign(&p, 64, 0) == 0 && p != NULL);
+    free(p);
+    p = malloc(0);
+    CHECK(p != NULL);
+    CHECK(realloc(p, 0) == NULL);
+    free(NULL);
+
+    // libc's blocks: usable sizes come from libc, realloc moves them over
+    // with their contents, and free hands them back
+    for (size_t i = 0; i < EARLY; i += 4) {
+        size_t size = 24 + i * 40;
+        CHECK(malloc_usable_size(early[i]) >= size);
+        unsigned char *moved = realloc(early[i], size * 2);
+        CHECK(moved != NULL);
+        check_fill(moved, size, (unsigned char)(0xa0 + i));
+        free(moved);
+        early[i] = NULL;
+    }
+    for (size_t i = 0; i < EARLY; i++) {
+        if (early[i]) {
+            size_t size = i % 4 == 3 ? 512 * 1024 : 24 + i * 40;
+            check_fill(early[i], size, (unsigned char)(0xa0 + i));
+            free(early[i]);
+        }
+    }
+
+    // The heap is intact after all that
+    churn();
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#define MIB ((size_t)1024 * 1024)
+#define BLOCK (100 * 1000) /**< Past the small classes, so every block comes from the heap */
+#define CACHED 40 /**< Blocks the "cache" handler holds and drops */
+
+static void *CACHE[CACHED]; /**< What drop_cache gives back */
+static int NCACHED = 0;
+static int CALLS = 0; /**< Handler invocations */
+static size_t LAST_SIZE = 0; /**< Size the last invocation was told about */
+
+static tuhandle HANDLE = 0; /**< A handle drop_cache frees, which takes the movable-space lock */
+
+/**
+ * A well-behaved handler: frees its cache through every entry point it may use
+ */
+static void drop_cache(size_t size, void *arg) {
+    CHECK(arg == &NCACHED);
+    CALLS++;
+    LAST_SIZE = size;
+    for (int i = 0; i < NCACHED; i++) {
+        tufree(CACHE[i]);
+    }
+    NCACHED = 0;
+    if (HANDLE) {
+        tuhandle_free(HANDLE);
+        HANDLE = 0;
+    }
+    // Allocating in a handler is allowed; a failure must not recurse
+    tufree(tumalloc(64 * MIB));
+}
+
+/**
+ * Allocate BLOCK-sized blocks until one fails
+ *
+ * @param live Filled with the blocks
+ * @param max Room in live
+ * @return How many were allocated
+ */
+static size_t fill(void **live, size_t max) {
+    size_t n = 0;
+    while (n < max && (live[n] = tumalloc(BLOCK)) != NULL) {
+        n++;
+    }
+    return n;
+}
+
+static void release(void **live, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        tufree(live[i]);
+    }
+}
+
+int main(void) {
+    static void *live[4096];
+    alarm(30);      // a deadlocked handler fails the test instead of hanging it
+
+    // Registration
+    CHECK(tumalloc_add_pressure_handler(NULL, NULL) == -1);
+    CHECK(tumalloc_add_pressure_handler(drop_cache, &NCACHED) == 0);
+    CHECK(tumalloc_remove_pressure_handler(drop_cache, NULL) == -1);
+
+    // Handlers run before an allocation fails, and what they free is reused
+    CHECK(tumalloc_set_limits(0, tumalloc_footprint() + 16 * MIB) == 0);
+    for (NCACHED = 0; NCACHED < CACHED; NCACHED++) {
+        CACHE[NCACHED] = tumalloc(BLOCK);
+        CHECK(CACHE[NCACHED] != NULL);
+    }
+    size_t n = fill(live, 4096);
+    CHECK(CALLS >= 1 && LAST_SIZE == BLOCK);
+    CHECK(NCACHED == 0);
+    CHECK(n > 16 * MIB / BLOCK - 10);       // the cache's room went to new blocks
+    release(live, n);
+
+    // The emergency reserve goes back on the first failure the handlers
+    // can't fix. It counts against the limit while held, so the same
+    // workload gets about as far with it as without it
+    size_t plain = fill(live, 4096);
+    release(live, plain);
+    CHECK(tumalloc_set_reserve(2 * MIB) == 0);
+    CHECK(tumalloc_reserve() >= 2 * MIB);
+    CALLS = 0;
+    n = fill(live, 4096);
+    CHECK(CALLS >= 1);
+    CHECK(tumalloc_reserve() == 0);
+    CHECK(n + 1 >= plain);
+    release(live, n);
+
+    // A handler may free a handle even when movable space is what failed to
+    // grow: the allocator's own allocations under its locks skip the handlers
+    n = fill(live, 4096);
+    CALLS = 0;
+    HANDLE = 1;     // not live, but freeing it still takes the lock
+    tuhandle big = tuhandle_alloc(8 * MIB);
+    CHECK(big == 0 && CALLS == 0);
+    release(live, n);
+
+    HANDLE = tuhandle_alloc(4 * MIB);
+    CHECK(HANDLE != 0);
+    n = fill(live, 4096);
+    CHECK(CALLS >= 1 && HANDLE == 0);
+    release(live, n);
+
+    CHECK(tumalloc_remove_pressure_handler(drop_cache, &NCACHED) == 0);
+    CHECK(tumalloc_remove_pressure_handler(drop_cache, &NCACHED) == -1);
+    CALLS = 0;
+    release(live, fill(live, 4096));
+    CHECK(CALLS == 0);
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define BLOCKS 600 /**< Enough blocks of one class to fill a good number of slabs */
+#define SIZE 500 /**< A small class with a handful of blocks per slab */
+
+static void *BLOCK[BLOCKS];
+
+/**
+ * The slab a small block belongs to: its header's next field
+ */
+static void *slab_of(void *ptr) {
+    return ((free_block *)ptr - 1)->next;
+}
+
+/**
+ * Free every block of a slab but the one at index keep, from a thread whose
+ * exit flushes them to the slab instead of leaving them in a thread cache
+ */
+static void *free_slab_main(void *arg) {
+    size_t keep = *(size_t *)arg;
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (i != keep && BLOCK[i] && slab_of(BLOCK[i]) == slab_of(BLOCK[keep])) {
+            tufree(BLOCK[i]);
+            BLOCK[i] = NULL;
+        }
+    }
+    return NULL;
+}
+
+static void free_slab_but(size_t keep) {
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, free_slab_main, &keep) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+}
+
+/**
+ * Blocks of a slab that was emptied out are worth moving and blocks of a
+ * full one are not; the batch call agrees with the single one; and
+ * tumalloc_relocate moves the contents and frees the old block to its slab
+ */
+int main(void) {
+    for (size_t i = 0; i < BLOCKS; i++) {
+        BLOCK[i] = tumalloc(SIZE);
+        CHECK(BLOCK[i] != NULL);
+        memset(BLOCK[i], (int)(i & 0xff), SIZE);
+    }
+
+    // Full slabs are the ones this test holds the most blocks of
+    size_t per_slab = 0;
+    size_t count[BLOCKS] = { 0 };
+    for (size_t i = 0; i < BLOCKS; i++) {
+        size_t first = 0;
+        while (slab_of(BLOCK[first]) != slab_of(BLOCK[i])) {
+            first++;
+        }
+        count[first]++;
+        per_slab = count[first] > per_slab ? count[first] : per_slab;
+    }
+    size_t full[3];
+    size_t nfull = 0;
+    for (size_t i = 0; i < BLOCKS && nfull < 3; i++) {
+        if (count[i] == per_slab) {
+            full[nfull++] = i;
+        }
+    }
+    CHECK(nfull == 3 && per_slab > 2);
+    size_t sparse = full[0], head = full[1], kept_full = full[2];
+    size_t neighbour = kept_full + 1;
+    while (slab_of(BLOCK[neighbour]) != slab_of(BLOCK[kept_full])) {
+        neighbour++;
+    }
+
+    // Empty two slabs down to one block; the second lands at the head of the partial list
+    free_slab_but(sparse);
+    free_slab_but(head);
+    CHECK(tumalloc_should_move(BLOCK[sparse]) == 1);
+    CHECK(tumalloc_should_move(BLOCK[kept_full]) == 0);
+    CHECK(tumalloc_should_move(BLOCK[head]) == 0);
+    CHECK(tumalloc_should_move(NULL) == 0);
+
+    void *large = tumalloc(64 * 1024);
+    CHECK(large != NULL);
+    CHECK(tumalloc_should_move(large) == 0);
+
+    // The batch agrees with the single calls, NULL entries included
+    void *batch[] = { BLOCK[sparse], BLOCK[kept_full], NULL, BLOCK[head], large, BLOCK[neighbour] };
+    size_t n = sizeof(batch) / sizeof(batch[0]);
+    unsigned char out[sizeof(batch) / sizeof(batch[0])];
+    size_t moves = tumalloc_should_move_batch(batch, n, out);
+    size_t expect = 0;
+    for (size_t i = 0; i < n; i++) {
+        CHECK(out[i] == (unsigned char)tumalloc_should_move(batch[i]));
+        expect += out[i];
+    }
+    CHECK(moves == expect && moves == 1);
+
+    // Relocating keeps the contents and frees the old block: a full slab
+    // then has exactly that slot free, which tumalloc_near hands back
+    void *old = BLOCK[kept_full];
+    void *moved = tumalloc_relocate(old);
+    CHECK(moved != NULL && moved != old);
+    CHECK(slab_of(moved) != slab_of(old));
+    for (size_t j = 0; j < SIZE; j++) {
+        CHECK(((unsigned char *)moved)[j] == (unsigned char)(kept_full & 0xff));
+    }
+    CHECK(tumalloc_near(BLOCK[neighbour], SIZE) == old);
+
+    // The sparse slab's last block moves out too, leaving large blocks in place
+    void *last = tumalloc_relocate(BLOCK[sparse]);
+    CHECK(last != NULL && last != BLOCK[sparse]);
+    CHECK(((unsigned char *)last)[SIZE - 1] == (unsigned char)(sparse & 0xff));
+    CHECK(tumalloc_relocate(large) == large);
+    CHECK(tumalloc_relocate(NULL) == NULL);
+    return 0;
+}
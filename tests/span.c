@@ -0,0 +1,74 @@
+#include "alloc.h"
+#include "check.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define SPANS 300 /**< Enough to grow span chunks to their widest */
+#define PAGE 4096
+
+static size_t size_of(size_t i) {
+    return 16 * 1024 + (i * 7919) % (200 * 1024);
+}
+
+static void fill(unsigned char *p, size_t i) {
+    memset(p, (int)(i & 0xff), size_of(i));
+}
+
+static void check(const unsigned char *p, size_t i) {
+    for (size_t j = 0; j < size_of(i); j += 97) {
+        CHECK(p[j] == (unsigned char)(i & 0xff));
+    }
+    CHECK(p[size_of(i) - 1] == (unsigned char)(i & 0xff));
+}
+
+/**
+ * Blocks of a few pages come from page runs of the page heap: each fills
+ * whole pages, holes left by frees are reused, contents survive around
+ * them, and freeing everything gives the chunks back
+ */
+int main(void) {
+    tufree(tumalloc(size_of(0)));       // warm-up, so the base footprint is settled
+    size_t base = tumalloc_footprint();
+
+    static unsigned char *live[SPANS];
+    for (size_t i = 0; i < SPANS; i++) {
+        live[i] = tumalloc(size_of(i));
+        CHECK(live[i] != NULL);
+        // The block ends where its last page does, and its header sits on the first page
+        size_t usable = tumalloc_usable_size(live[i]);
+        CHECK(usable >= size_of(i) && usable - size_of(i) < PAGE);
+        CHECK(((uintptr_t)live[i] + usable) % PAGE == 0);
+        CHECK((uintptr_t)live[i] % PAGE < 64);
+        fill(live[i], i);
+    }
+
+    // Punch holes and fill them with blocks of the same sizes
+    for (size_t i = 0; i < SPANS; i += 2) {
+        tufree(live[i]);
+    }
+    size_t reused = 0;
+    for (size_t i = 0; i < SPANS; i += 2) {
+        unsigned char *old = live[i];
+        live[i] = tumalloc(size_of(i));
+        CHECK(live[i] != NULL);
+        reused += live[i] == old;
+        fill(live[i], i);
+    }
+    CHECK(reused > 0);
+    CHECK(tumalloc_footprint() - base < (size_t)2 * SPANS * 220 * 1024);
+    for (size_t i = 0; i < SPANS; i++) {
+        check(live[i], i);
+    }
+
+    // A span can be reallocated into a bigger one and keeps its contents
+    live[1] = turealloc(live[1], size_of(1) + 100 * 1024);
+    CHECK(live[1] != NULL);
+    check(live[1], 1);
+
+    for (size_t i = 0; i < SPANS; i++) {
+        tufree(live[i]);
+    }
+    CHECK(tumalloc_footprint() == base);
+    return 0;
+}